@@ -1,5 +1,10 @@
 package com.tal.hybridge;
 
+import java.lang.reflect.Field;
+import java.lang.reflect.Method;
+import java.lang.reflect.Modifier;
+import java.util.ArrayList;
+
 public abstract class Channel
 {
     private long handle_ = 0;
@@ -46,6 +51,20 @@ public abstract class Channel
         disconnectFrom(handle_, transport.handle());
     }
 
+    /* Collected objects are dropped from the registry in small steps on
+       each registerObject/propertyChanged call and on each timer event */
+
+    public static native void setSweepBudget(int perCall, int perTimer);
+
+    /* Class metadata snapshot, open() before registering objects to skip
+       reflection of known classes, save() once they have been used. The
+       version identifies the app build, e.g. its version code and install
+       time, a snapshot saved with another version is ignored */
+
+    public static native boolean openMetaSnapshot(String path, String version);
+
+    public static native boolean saveMetaSnapshot();
+
     /* Protected methods called by devided class */
 
     protected void propertyChanged(Object object, String name) {
@@ -64,6 +83,39 @@ public abstract class Channel
 
     protected abstract void stopTimer();
 
+    /* Called by native meta objects to reflect a class in one call: the
+       declared fields with names, modifiers and types, then the public, non
+       static, non abstract methods with names, return and parameter types */
+
+    private static Object[] declaredMembers(Class<?> clazz) {
+        Field[] fields = clazz.getDeclaredFields();
+        String[] fieldNames = new String[fields.length];
+        int[] fieldModifiers = new int[fields.length];
+        Class<?>[] fieldTypes = new Class<?>[fields.length];
+        for (int i = 0; i < fields.length; ++i) {
+            fieldNames[i] = fields[i].getName();
+            fieldModifiers[i] = fields[i].getModifiers();
+            fieldTypes[i] = fields[i].getType();
+        }
+        ArrayList<Method> list = new ArrayList<>();
+        for (Method method : clazz.getDeclaredMethods()) {
+            int mod = method.getModifiers();
+            if (Modifier.isPublic(mod) && !Modifier.isStatic(mod) && !Modifier.isAbstract(mod))
+                list.add(method);
+        }
+        Method[] methods = list.toArray(new Method[list.size()]);
+        String[] methodNames = new String[methods.length];
+        Class<?>[] returnTypes = new Class<?>[methods.length];
+        Class<?>[][] parameterTypes = new Class<?>[methods.length][];
+        for (int i = 0; i < methods.length; ++i) {
+            methodNames[i] = methods[i].getName();
+            returnTypes[i] = methods[i].getReturnType();
+            parameterTypes[i] = methods[i].getParameterTypes();
+        }
+        return new Object[] { fields, fieldNames, fieldModifiers, fieldTypes,
+                methods, methodNames, returnTypes, parameterTypes };
+    }
+
     /* Native methods */
 
     private native long create();
@@ -43,9 +43,17 @@ public class ProxyObject {
         return writeProperty(handle_, property, value);
     }
     
+	public int methodIndex(Method method) {
+        return methodIndex(handle_, method);
+    }
+
 	public boolean invokeMethod(Method method, Object[] args, OnResult onResult) {
         return invokeMethod(handle_, method, args, onResult);
     }
+
+	public boolean invokeMethod(int methodIndex, Object[] args, OnResult onResult) {
+        return invokeMethod(handle_, methodIndex, args, onResult);
+    }
     
 	public boolean connect(int signalIndex, SignalHandler handler) {
         ArrayList<SignalHandler> handlers = connections_.get(signalIndex);
@@ -71,8 +79,12 @@ public class ProxyObject {
 
     private native boolean writeProperty(long handle, String property, Object value);
 
+    private native int methodIndex(long handle, Method method);
+
     private native boolean invokeMethod(long handle, Method method, Object[] args, OnResult onResult);
 
+    private native boolean invokeMethod(long handle, int methodIndex, Object[] args, OnResult onResult);
+
     private native boolean connect(long handle, int signalIndex, SignalHandler handler);
 
     private native boolean disconnect(long handle, int signalIndex, SignalHandler handler);
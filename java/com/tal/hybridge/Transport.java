@@ -1,8 +1,26 @@
 package com.tal.hybridge;
 
+import java.io.ByteArrayOutputStream;
+import java.nio.Buffer;
+import java.nio.ByteBuffer;
+import java.nio.charset.StandardCharsets;
+
 public abstract class Transport
 {
+    /* Wire formats of buffer mode. JSON always sends JSON. MSGPACK and
+       AUTO negotiate: the JSON they send starts with a tab, which tells a
+       Hybridge peer they decode MessagePack and any other peer ignores.
+       Both send MessagePack while the peer sends MessagePack or marked
+       JSON, and JSON once it sends plain JSON. MSGPACK starts out with
+       MessagePack, for peers known to be Hybridge. AUTO starts out with
+       JSON and upgrades with the first answer of a Hybridge peer. */
+
+    public static final int FORMAT_JSON = 0;
+    public static final int FORMAT_MSGPACK = 1;
+    public static final int FORMAT_AUTO = 2;
+
     private long handle_ = 0;
+    private ByteArrayOutputStream pending_ = null;
 
     public Transport() {
         handle_ = create();
@@ -18,14 +36,137 @@ public abstract class Transport
          return handle_;
     }
 
+    /* Buffer mode: outgoing messages are UTF-8 JSON in a direct ByteBuffer
+       owned by the native side, no String is created for them */
+
+    public void setBufferMode(boolean enable) {
+        setBufferMode(handle_, enable);
+    }
+
+    public void setWireFormat(int format) {
+        setWireFormat(handle_, format);
+    }
+
+    /* In buffer mode, messages are written in pieces of at most size bytes
+       and handed to sendChunk() as each piece fills up, so native memory
+       stays at one chunk whatever the message size. 0 disables it. */
+
+    public void setChunkSize(int size) {
+        setChunkSize(handle_, size);
+    }
+
+    /* Messages sent during a channel timer event, or in reply to a received
+       message, are queued and sent as one array when it ends or once limit
+       messages are queued. The peer must be Hybridge, which unpacks arrays
+       on receive. 0 sends every message on its own. */
+
+    public void setBatchLimit(int limit) {
+        setBatchLimit(handle_, limit);
+    }
+
+    /* With a limit, messages are serialized and sent in order on a native
+       thread of their own, and a slow sendMessage() no longer holds up the
+       channel. Senders never wait: a message sent while limit messages are
+       queued is reported to sendFailed() on the sending thread, and the
+       transport sends nothing from then on, as the peer would see a gap.
+       Disconnect it and connect a new one. 0 sends on the calling thread
+       again, after the queue has drained. */
+
+    public void setSendQueue(int limit) {
+        setSendQueue(handle_, limit);
+    }
+
     protected abstract void sendMessage(String message);
 
+    /* The buffer is reused for the next message, consume it before
+       returning. Transports that only implement the String variant
+       get the decoded message, which only works with FORMAT_JSON. */
+
+    protected void sendMessage(ByteBuffer message) {
+        sendMessage(StandardCharsets.UTF_8.decode(message).toString());
+    }
+
+    /* The chunk buffer is reused as well. Transports that do not stream
+       get the chunks of a message joined into one sendMessage() call. */
+
+    protected void sendChunk(ByteBuffer chunk, boolean last) {
+        if (pending_ == null && last) {
+            sendMessage(chunk);
+            return;
+        }
+        if (pending_ == null)
+            pending_ = new ByteArrayOutputStream();
+        byte[] bytes = new byte[chunk.remaining()];
+        chunk.get(bytes);
+        pending_.write(bytes, 0, bytes.length);
+        if (last) {
+            ByteBuffer message = ByteBuffer.wrap(pending_.toByteArray());
+            pending_ = null;
+            sendMessage(message);
+        }
+    }
+
+    /* Called on the send thread when sendMessage() or sendChunk() threw
+       there, as there is no caller to throw to, and on the sending thread
+       once the send queue overflowed */
+
+    protected void sendFailed(Throwable error) {
+        error.printStackTrace();
+    }
+
+    /* Malformed messages are not dispatched, a RuntimeException is thrown
+       instead */
+
     protected void messageReceived(String message) {
         messageReceived(handle_, message);
     }
 
+    /* Parsed in place from position to limit, message must be direct.
+       JSON and MessagePack are told apart by the first byte. */
+
+    protected void messageReceived(ByteBuffer message) {
+        messageReceived(handle_, message, message.position(), message.remaining());
+    }
+
+    private void sendBuffer(ByteBuffer buffer, int length) {
+        // through Buffer, ByteBuffer only has covariant overrides on newer runtimes
+        Buffer b = buffer;
+        b.clear();
+        b.limit(length);
+        sendMessage(buffer);
+    }
+
+    private void sendChunk(ByteBuffer buffer, int length, boolean last) {
+        Buffer b = buffer;
+        b.clear();
+        b.limit(length);
+        try {
+            sendChunk(buffer, last);
+        } catch (RuntimeException e) {
+            // the rest of this message will not come
+            pending_ = null;
+            throw e;
+        }
+    }
+
+    private void sendQueueFull() {
+        sendFailed(new IllegalStateException("send queue full, transport stopped sending"));
+    }
+
     private native void messageReceived(long handle, String message);
 
+    private native void messageReceived(long handle, ByteBuffer message, int offset, int length);
+
+    private native void setBufferMode(long handle, boolean enable);
+
+    private native void setWireFormat(long handle, int format);
+
+    private native void setChunkSize(long handle, int size);
+
+    private native void setBatchLimit(long handle, int limit);
+
+    private native void setSendQueue(long handle, int limit);
+
     private native long create();
 
     private native void free(long handle);
@@ -24,9 +24,13 @@ SOURCES += \
     hybridgejni.cpp \
     jnichannel.cpp \
     jniclass.cpp \
+    jnijson.cpp \
     jnimeta.cpp \
+    jnimsgpack.cpp \
+    jnimetasnapshot.cpp \
     jniproxyobject.cpp \
     jnitransport.cpp \
+    jniutf.cpp \
     jnivariant.cpp
 
 HEADERS += \
@@ -34,9 +38,15 @@ HEADERS += \
     hybridgejni.h \
     jnichannel.h \
     jniclass.h \
+    jnihandletable.h \
+    jnijson.h \
     jnimeta.h \
+    jnimsgpack.h \
+    jnioutput.h \
+    jnimetasnapshot.h \
     jniproxyobject.h \
     jnitransport.h \
+    jniutf.h \
     jnivariant.h
 
 # Default rules for deployment.
@@ -1,13 +1,17 @@
 #include "hybridgejni.h"
 #include "jnichannel.h"
 #include "jniclass.h"
+#include "jnihandletable.h"
 #include "jnimeta.h"
+#include "jnimetasnapshot.h"
 #include "jniproxyobject.h"
 #include "jnitransport.h"
 #include "jnivariant.h"
 
-#include <mutex>
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <mutex>
 
 static jclass sc_RuntimeException = nullptr;
 
@@ -22,6 +26,7 @@ JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void*)
     int status = vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6);
     if (status != JNI_OK)
         return status;
+    setJavaVM(vm);
     // RuntimeException
     sc_RuntimeException = env->FindClass("java/lang/RuntimeException");
     if (sc_RuntimeException == nullptr) {
@@ -40,6 +45,9 @@ JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void*)
         {"propertyChanged", "(JLjava/lang/Object;Ljava/lang/String;)V", reinterpret_cast<void*>(&JChannel::propertyChanged)},
         {"timerEvent", "(J)V", reinterpret_cast<void*>(&JChannel::timerEvent)},
         {"free", "(J)V", reinterpret_cast<void*>(&JChannel::free)},
+        {"setSweepBudget", "(II)V", reinterpret_cast<void*>(&JChannel::setSweepBudget)},
+        {"openMetaSnapshot", "(Ljava/lang/String;Ljava/lang/String;)Z", reinterpret_cast<void*>(&JChannel::openMetaSnapshot)},
+        {"saveMetaSnapshot", "()Z", reinterpret_cast<void*>(&JChannel::saveMetaSnapshot)},
     };
     jclass clazzChannel = env->FindClass("com/tal/hybridge/Channel");
     if (clazzChannel == nullptr) {
@@ -53,6 +61,12 @@ JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void*)
     JNINativeMethod methodsTransport[] = {
         {"create", "()J", reinterpret_cast<void*>(&JTransport::create)},
         {"messageReceived", "(JLjava/lang/String;)V", reinterpret_cast<void*>(&JTransport::messageReceived)},
+        {"messageReceived", "(JLjava/nio/ByteBuffer;II)V", reinterpret_cast<void*>(&JTransport::messageReceived2)},
+        {"setBufferMode", "(JZ)V", reinterpret_cast<void*>(&JTransport::setBufferMode)},
+        {"setWireFormat", "(JI)V", reinterpret_cast<void*>(&JTransport::setWireFormat)},
+        {"setChunkSize", "(JI)V", reinterpret_cast<void*>(&JTransport::setChunkSize)},
+        {"setBatchLimit", "(JI)V", reinterpret_cast<void*>(&JTransport::setBatchLimit)},
+        {"setSendQueue", "(JI)V", reinterpret_cast<void*>(&JTransport::setSendQueue)},
         {"free", "(J)V", reinterpret_cast<void*>(&JTransport::free)},
     };
     jclass clazzTransport = env->FindClass("com/tal/hybridge/Transport");
@@ -66,54 +80,66 @@ JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void*)
     JNINativeMethod methodsProxyObject[] = {
         {"readProperty", "(JLjava/lang/String;)Ljava/lang/Object;", reinterpret_cast<void*>(&JProxyObject::readProperty)},
         {"writeProperty", "(JLjava/lang/String;Ljava/lang/Object;)Z", reinterpret_cast<void*>(&JProxyObject::writeProperty)},
+        {"methodIndex", "(JLjava/lang/reflect/Method;)I", reinterpret_cast<void*>(&JProxyObject::methodIndex)},
         {"invokeMethod", "(JLjava/lang/reflect/Method;[Ljava/lang/Object;Lcom/tal/hybridge/ProxyObject$OnResult;)Z",
             reinterpret_cast<void*>(&JProxyObject::invokeMethod)},
+        {"invokeMethod", "(JI[Ljava/lang/Object;Lcom/tal/hybridge/ProxyObject$OnResult;)Z",
+            reinterpret_cast<void*>(&JProxyObject::invokeMethod2)},
         {"connect", "(JILcom/tal/hybridge/ProxyObject$SignalHandler;)Z", reinterpret_cast<void*>(&JProxyObject::connect)},
         {"disconnect", "(JILcom/tal/hybridge/ProxyObject$SignalHandler;)Z", reinterpret_cast<void*>(&JProxyObject::disconnect)},
     };
     jclass clazzProxyObject = env->FindClass("com/tal/hybridge/ProxyObject");
-    if (clazzTransport == nullptr) {
+    if (clazzProxyObject == nullptr) {
         return JNI_ERR;
     }
-    status = env->RegisterNatives(clazzProxyObject, reinterpret_cast<JNINativeMethod*>(methodsProxyObject), sizeof(methodsTransport) / sizeof(methodsTransport[0]));
+    status = env->RegisterNatives(clazzProxyObject, reinterpret_cast<JNINativeMethod*>(methodsProxyObject), sizeof(methodsProxyObject) / sizeof(methodsProxyObject[0]));
     if (status != JNI_OK)
         return status;
+    // Resolve all cached classes and ids here: FindClass on other threads
+    // only sees the system class loader, and hot paths never look them up
+    classClass(env);
+    methodClass(env);
+    fieldClass(env);
+    modifierClass(env);
+    systemClass(env);
+    channelClass(env);
+    transportClass(env);
+    proxyObjectClass(env);
+    onResultClass(env);
+    signalHandlerClass(env);
     JniVariant::init(env);
     return JNI_VERSION_1_6;
 }
 
-static std::vector<std::shared_ptr<JniChannel>> channels(1, nullptr);
-static std::vector<std::shared_ptr<JniTransport>> transports(1, nullptr);
-static std::recursive_mutex smutex;
+static JniHandleTable<JniChannel> channels;
+static JniHandleTable<JniTransport> transports;
 
 JNIEXPORT void JNI_OnUnload(JavaVM*, void*)
 {
     std::cout << "JNI_OnUnload" << std::endl;
-    std::lock_guard<std::recursive_mutex> l(smutex);
     transports.clear();
     channels.clear();
 }
 
+// Handles pin their objects until the native call returns, a concurrent
+// free() only takes effect after that. Calls into a channel are serialized
+// by the channel lock, so any attached java thread may drive it.
+
 #define C(env, channel) \
-    std::lock_guard<std::recursive_mutex> lc(smutex); \
-    if (channel >= static_cast<jlong>(channels.size())) { \
-        env->ThrowNew(sc_RuntimeException, "channel index out of range"); \
-        return F; \
-    } \
-    std::shared_ptr<JniChannel> & c = channels[static_cast<size_t>(channel)]; \
-    if (c == nullptr) { \
+    JniHandleTable<JniChannel>::Ref c = channels.get(channel); \
+    if (!c) { \
         env->ThrowNew(sc_RuntimeException, "channel item not found"); \
         return F; \
-    }
+    } \
+    std::lock_guard<std::recursive_mutex> lock(*c->mutex_);
+
+#define P(handle) \
+    JniProxyObject * jpo = reinterpret_cast<JniProxyObject*>(handle); \
+    std::lock_guard<std::recursive_mutex> lock(*jpo->channelMutex_);
 
 #define T(env, transport) \
-    std::lock_guard<std::recursive_mutex> lt(smutex); \
-    if (transport >= static_cast<jlong>(transports.size())) { \
-        env->ThrowNew(sc_RuntimeException, "transport index out of range"); \
-        return F; \
-    } \
-    std::shared_ptr<JniTransport> & t = transports[static_cast<size_t>(transport)]; \
-    if (t == nullptr) { \
+    JniHandleTable<JniTransport>::Ref t = transports.get(transport); \
+    if (!t) { \
         env->ThrowNew(sc_RuntimeException, "transport item not found"); \
         return F; \
     }
@@ -121,14 +147,10 @@ JNIEXPORT void JNI_OnUnload(JavaVM*, void*)
 jlong JChannel::create(JNIEnv *env, jobject handle)
 {
     std::cout << "JChannel::create" << std::endl;
-    std::shared_ptr<JniChannel> c(new JniChannel(env, handle));
-    std::lock_guard<std::recursive_mutex> l(smutex);
-    auto iter = std::find(channels.begin() + 1, channels.end(), nullptr);
-    if (iter == channels.end())
-        iter = channels.insert(iter, c);
-    else
-        *iter = c;
-    return std::distance(channels.begin(), iter);
+    jlong channel = channels.create(new JniChannel(env, handle));
+    if (channel == 0)
+        env->ThrowNew(sc_RuntimeException, "too many channels");
+    return channel;
 }
 
 void JChannel::registerObject(JNIEnv *env, jobject, jlong channel, jstring name, jobject object)
@@ -195,81 +217,159 @@ void JChannel::timerEvent(JNIEnv *env, jobject, jlong channel)
 void JChannel::free(JNIEnv *env, jobject, jlong channel)
 {
     std::cout << "JChannel::free" << std::endl;
-    C(env, channel)
-    c.reset();
+    if (!channels.remove(channel))
+        env->ThrowNew(sc_RuntimeException, "channel item not found");
+}
+
+void JChannel::setSweepBudget(JNIEnv *, jclass, jint perCall, jint perTimer)
+{
+    JniChannel::setSweepBudget(static_cast<size_t>(std::max(perCall, 0)),
+                               static_cast<size_t>(std::max(perTimer, 0)));
+}
+
+jboolean JChannel::openMetaSnapshot(JNIEnv *env, jclass, jstring path, jstring version)
+{
+    return JniMetaSnapshot::open(env, JString(env, path), JString(env, version));
+}
+
+jboolean JChannel::saveMetaSnapshot(JNIEnv *env, jclass)
+{
+    return JniMetaSnapshot::save(env);
 }
 
 jlong JTransport::create(JNIEnv *env, jobject handle)
 {
     std::cout << "JTransport::create" << std::endl;
-    std::shared_ptr<JniTransport> t(new JniTransport(env, handle));
-    std::lock_guard<std::recursive_mutex> l(smutex);
-    auto iter = std::find(transports.begin() + 1, transports.end(), nullptr);
-    if (iter == transports.end())
-        iter = transports.insert(iter, t);
-    else
-        *iter = t;
-    return std::distance(transports.begin(), iter);
+    jlong transport = transports.create(new JniTransport(env, handle));
+    if (transport == 0)
+        env->ThrowNew(sc_RuntimeException, "too many transports");
+    return transport;
 }
 
 void JTransport::messageReceived(JNIEnv *env, jobject, jlong transport, jstring message)
 {
     std::cout << "JTransport::messageReceived" << std::endl;
     T(env, transport)
-    t->messageReceived(message);
+    std::shared_ptr<std::recursive_mutex> mutex = t->mutex();
+    std::unique_lock<std::recursive_mutex> lock;
+    if (mutex)
+        lock = std::unique_lock<std::recursive_mutex>(*mutex);
+    // GetStringCritical leaves an OutOfMemoryError pending
+    if (t->messageReceived(message) != JniTransport::Dispatched && !env->ExceptionCheck())
+        env->ThrowNew(sc_RuntimeException, "malformed message");
 }
 
-void JTransport::free(JNIEnv *env, jobject, jlong transport)
+void JTransport::messageReceived2(JNIEnv *env, jobject, jlong transport, jobject buffer, jint offset, jint length)
 {
-    std::cout << "JTransport::free" << std::endl;
     T(env, transport)
-    t.reset();
+    std::shared_ptr<std::recursive_mutex> mutex = t->mutex();
+    std::unique_lock<std::recursive_mutex> lock;
+    if (mutex)
+        lock = std::unique_lock<std::recursive_mutex>(*mutex);
+    switch (t->messageReceived(buffer, offset, length)) {
+    case JniTransport::BadBuffer:
+        env->ThrowNew(sc_RuntimeException, "direct buffer required");
+        break;
+    case JniTransport::BadMessage:
+        env->ThrowNew(sc_RuntimeException, "malformed message");
+        break;
+    default:
+        break;
+    }
 }
 
-jobject JProxyObject::readProperty(JNIEnv *env, jobject, jlong handle, jstring property)
+void JTransport::setBufferMode(JNIEnv *env, jobject, jlong transport, jboolean enable)
 {
-    ProxyObject * po = reinterpret_cast<ProxyObject*>(handle);
-    MetaObject const * meta = po->metaObj();
-    JniMetaProperty jmp(JString(env, property));
-    for (size_t i = 0; i < meta->propertyCount(); ++i) {
-        MetaProperty const & mp = meta->property(i);
-        if (jmp == mp) {
-            Array emptyArray;
-            return JniVariant::fromValue(mp.read(po));
-        }
+    T(env, transport)
+    t->setBufferMode(enable);
+}
+
+void JTransport::setWireFormat(JNIEnv *env, jobject, jlong transport, jint format)
+{
+    if (format < JniTransport::Json || format > JniTransport::Auto) {
+        env->ThrowNew(sc_RuntimeException, "unknown wire format");
+        return;
     }
-    return nullptr;
+    T(env, transport)
+    t->setWireFormat(static_cast<JniTransport::WireFormat>(format));
 }
 
-jboolean JProxyObject::writeProperty(JNIEnv *env, jobject, jlong handle, jstring property, jobject value)
+void JTransport::setChunkSize(JNIEnv *env, jobject, jlong transport, jint size)
 {
-    ProxyObject * po = reinterpret_cast<ProxyObject*>(handle);
-    MetaObject const * meta = po->metaObj();
-    JniMetaProperty jmp(JString(env, property));
-    for (size_t i = 0; i < meta->propertyCount(); ++i) {
-        MetaProperty const & mp = meta->property(i);
-        if (jmp == mp) {
-            Array emptyArray;
-            return mp.write(po, JniVariant::toValue(value));
-        }
+    if (size < 0) {
+        env->ThrowNew(sc_RuntimeException, "negative chunk size");
+        return;
     }
-    return false;
+    T(env, transport)
+    t->setChunkSize(static_cast<size_t>(size));
+}
+
+void JTransport::setBatchLimit(JNIEnv *env, jobject, jlong transport, jint limit)
+{
+    if (limit < 0) {
+        env->ThrowNew(sc_RuntimeException, "negative batch limit");
+        return;
+    }
+    T(env, transport)
+    t->setBatchLimit(static_cast<size_t>(limit));
+}
+
+void JTransport::setSendQueue(JNIEnv *env, jobject, jlong transport, jint limit)
+{
+    if (limit < 0) {
+        env->ThrowNew(sc_RuntimeException, "negative queue limit");
+        return;
+    }
+    T(env, transport)
+    if (!t->setSendQueue(static_cast<size_t>(limit)))
+        env->ThrowNew(sc_RuntimeException, "send queue changed from within a send");
+}
+
+void JTransport::free(JNIEnv *env, jobject, jlong transport)
+{
+    std::cout << "JTransport::free" << std::endl;
+    if (!transports.remove(transport))
+        env->ThrowNew(sc_RuntimeException, "transport item not found");
+}
+
+jobject JProxyObject::readProperty(JNIEnv *, jobject, jlong handle, jstring property)
+{
+    P(handle)
+    return jpo->readProperty(property);
+}
+
+jboolean JProxyObject::writeProperty(JNIEnv *, jobject, jlong handle, jstring property, jobject value)
+{
+    P(handle)
+    return jpo->writeProperty(property, value);
+}
+
+jint JProxyObject::methodIndex(JNIEnv *, jobject, jlong handle, jobject method)
+{
+    P(handle)
+    return jpo->methodIndex(method);
 }
 
 jboolean JProxyObject::invokeMethod(JNIEnv *, jobject, jlong handle, jobject method, jobjectArray args, jobject onResult)
 {
-    JniProxyObject * jpo = reinterpret_cast<JniProxyObject*>(handle);
+    P(handle)
     return jpo->invokeMethod(method, args, onResult);
 }
 
+jboolean JProxyObject::invokeMethod2(JNIEnv *, jobject, jlong handle, jint methodIndex, jobjectArray args, jobject onResult)
+{
+    P(handle)
+    return jpo->invokeMethod(methodIndex, args, onResult);
+}
+
 jboolean JProxyObject::connect(JNIEnv *, jobject, jlong handle, jint signalIndex, jobject handler)
 {
-    JniProxyObject * jpo = reinterpret_cast<JniProxyObject*>(handle);
+    P(handle)
     return jpo->connect(signalIndex, handler);
 }
 
 jboolean JProxyObject::disconnect(JNIEnv *, jobject, jlong handle, jint signalIndex, jobject handler)
 {
-    JniProxyObject * jpo = reinterpret_cast<JniProxyObject*>(handle);
+    P(handle)
     return jpo->disconnect(signalIndex, handler);
 }
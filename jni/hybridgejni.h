@@ -17,12 +17,21 @@ struct JChannel
     static void propertyChanged(JNIEnv * env, jobject, jlong channel, jobject object, jstring name);
     static void timerEvent(JNIEnv * env, jobject, jlong channel);
     static void free(JNIEnv * env, jobject, jlong channel);
+    static void setSweepBudget(JNIEnv * env, jclass, jint perCall, jint perTimer);
+    static jboolean openMetaSnapshot(JNIEnv * env, jclass, jstring path, jstring version);
+    static jboolean saveMetaSnapshot(JNIEnv * env, jclass);
 };
 
 struct JTransport
 {
     static jlong create(JNIEnv * env, jobject);
     static void messageReceived(JNIEnv * env, jobject, jlong transport, jstring message);
+    static void messageReceived2(JNIEnv * env, jobject, jlong transport, jobject buffer, jint offset, jint length);
+    static void setBufferMode(JNIEnv * env, jobject, jlong transport, jboolean enable);
+    static void setWireFormat(JNIEnv * env, jobject, jlong transport, jint format);
+    static void setChunkSize(JNIEnv * env, jobject, jlong transport, jint size);
+    static void setBatchLimit(JNIEnv * env, jobject, jlong transport, jint limit);
+    static void setSendQueue(JNIEnv * env, jobject, jlong transport, jint limit);
     static void free(JNIEnv * env, jobject, jlong transport);
 };
 
@@ -30,7 +39,9 @@ struct JProxyObject
 {
     static jobject readProperty(JNIEnv *env, jobject, jlong handle, jstring property);
     static jboolean writeProperty(JNIEnv *env, jobject, jlong handle, jstring property, jobject value);
+    static jint methodIndex(JNIEnv *env, jobject, jlong handle, jobject method);
     static jboolean invokeMethod(JNIEnv *env, jobject, jlong handle, jobject method, jobjectArray args, jobject onResult);
+    static jboolean invokeMethod2(JNIEnv *env, jobject, jlong handle, jint methodIndex, jobjectArray args, jobject onResult);
     static jboolean connect(JNIEnv *env, jobject, jlong handle, jint signalIndex, jobject handler);
     static jboolean disconnect(JNIEnv *env, jobject, jlong handle, jint signalIndex, jobject handler);
 };
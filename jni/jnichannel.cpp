@@ -3,63 +3,65 @@
 #include "jniclass.h"
 #include "jnivariant.h"
 #include "jniproxyobject.h"
+#include "jnitransport.h"
 
 #include <algorithm>
 
 JniChannel::JniChannel(JNIEnv * env, jobject handle)
-    : env_(env)
-    , handle_(env_->NewWeakGlobalRef(handle))
+    : mutex_(std::make_shared<std::recursive_mutex>())
+    , handle_(env->NewWeakGlobalRef(handle))
 {
-    jclass clazz = env->GetObjectClass(handle);
-    createUuid_ = env->GetMethodID(clazz, "createUuid", "()Ljava/lang/String;");
-    startTimer_ = env->GetMethodID(clazz, "startTimer", "(I)V");
-    stopTimer_ = env->GetMethodID(clazz, "stopTimer", "()V");
-    classMetas_.emplace("java.lang.Object", new JniObjectMetaObject(env));
+    std::lock_guard<std::mutex> l(channelsMutex_);
+    channels_.push_back(this);
 }
 
 JniChannel::~JniChannel()
 {
-    env_->DeleteWeakGlobalRef(handle_);
+    {
+        std::lock_guard<std::mutex> l(channelsMutex_);
+        channels_.erase(std::find(channels_.begin(), channels_.end(), this));
+    }
+    env()->DeleteWeakGlobalRef(handle_);
 }
 
 MetaObject *JniChannel::metaObject(const Object *object) const
 {
     jobject jobj = static_cast<jobject>(const_cast<Object*>(object));
-    jclass jcls = env_->GetObjectClass(jobj);
+    JLocalClassRef jcls(env(), env()->GetObjectClass(jobj));
     return metaObject2(jcls);
 }
 
 std::string JniChannel::createUuid() const
 {
-    jobject uuid = env_->CallObjectMethod(handle_, createUuid_);
-    return JString(env_, uuid);
+    return channelClass().createUuid(handle_);
 }
 
 ProxyObject *JniChannel::createProxyObject(Map &&classinfo) const
 {
-    ProxyObject * po = new JniProxyObject(env_, std::move(classinfo));
+    ProxyObject * po = new JniProxyObject(env(), std::move(classinfo), mutex_);
     return po;
 }
 
 void JniChannel::startTimer(int msec)
 {
-    env_->CallVoidMethod(handle_, startTimer_, msec);
+    channelClass().startTimer(handle_, msec);
 }
 
 void JniChannel::stopTimer()
 {
-    env_->CallVoidMethod(handle_, stopTimer_);
+    channelClass().stopTimer(handle_);
 }
 
 void JniChannel::registerObject(const std::string &id, jobject object)
 {
-    object = JniVariant::registerObject(env_, object);
+    sweepObjects(sweepPerCall_);
+    object = JniVariant::registerObject(env(), object);
     Channel::registerObject(id, object);
 }
 
 void JniChannel::deregisterObject(jobject object)
 {
-    object = JniVariant::deregisterObject(env_, object);
+    object = JniVariant::deregisterObject(env(), object);
     if (object != nullptr) {
         Channel::deregisterObject(object);
     }
@@ -67,37 +69,145 @@ void JniChannel::deregisterObject(jobject object)
 
 void JniChannel::propertyChanged(jobject object, jstring property)
 {
-    JLocalClassRef clazz(env_, env_->GetObjectClass(object));
+    sweepObjects(sweepPerCall_);
+    JLocalClassRef clazz(env(), env()->GetObjectClass(object));
     JniMetaObject * meta = static_cast<JniMetaObject*>(metaObject2(clazz));
-    object = JniVariant::findObject(env_, object);
+    object = JniVariant::findObject(env(), object);
     if (object != nullptr) {
-        JniMetaProperty prop(JString(env_, property));
-        meta->propertyChanged(this, object, prop.propertyIndex());
+        size_t index = meta->propertyIndex(JString(env(), property).str());
+        if (index < meta->propertyCount())
+            meta->propertyChanged(this, object, index);
     }
 }
 
-void JniChannel::connectTo(Transport *transport, jobject response)
+void JniChannel::connectTo(JniTransport *transport, jobject response)
 {
     MetaMethod::Response resp;
     if (response) {
-        resp = [env = env_, response] (Value && result) {
-            onResultClass(env).apply(response, JniVariant::fromValue(result));
+        // the init reply comes with a later message, maybe on another thread
+        JSharedRef handler = newSharedRef(env(), response);
+        resp = [handler] (Value && result) {
+            OnResultClass & orc = onResultClass();
+            JLocalObjectRef r(orc.env(), JniVariant::fromValue(result));
+            orc.apply(handler.get(), r);
         };
     }
+    transport->setMutex(mutex_);
+    transports_.push_back(transport);
     Channel::connectTo(transport, resp);
 }
 
-std::map<std::string, JniMetaObject*> JniChannel::classMetas_;
+void JniChannel::disconnectFrom(JniTransport *transport)
+{
+    Channel::disconnectFrom(transport);
+    transport->setMutex(nullptr);
+    transports_.erase(std::remove(transports_.begin(), transports_.end(), transport), transports_.end());
+}
 
-JniMetaObject *JniChannel::metaObject2(jclass clazz) const
+void JniChannel::timerEvent()
+{
+    {
+        JniTransport::Batch batch(transports_);
+        Channel::timerEvent();
+    }
+    sweepObjects(sweepPerTimer_);
+}
+
+std::vector<JniChannel*> JniChannel::channels_;
+std::mutex JniChannel::channelsMutex_;
+std::atomic<size_t> JniChannel::sweepPerCall_(4);
+std::atomic<size_t> JniChannel::sweepPerTimer_(256);
+
+void JniChannel::setSweepBudget(size_t perCall, size_t perTimer)
 {
-    std::string name = classClass(env_).getName(clazz);
-    auto it = classMetas_.find(name);
-    if (it == classMetas_.end()) {
-        jclass super = classClass().getSuperclass(clazz);
-        JniMetaObject * smeta = metaObject2(super);
-        JniMetaObject * meta = new JniMetaObject(smeta, clazz);
-        it = classMetas_.insert(std::make_pair(name, meta)).first;
+    sweepPerCall_ = perCall;
+    sweepPerTimer_ = perTimer;
+}
+
+void JniChannel::sweepObjects(size_t budget)
+{
+    std::vector<jobject> collected;
+    if (budget)
+        JniVariant::sweepObjects(env(), budget, collected);
+    std::vector<std::shared_ptr<std::vector<jobject>>> pending;
+    {
+        // objects may have been published by any channel, each one
+        // deregisters them under its own lock
+        std::lock_guard<std::mutex> l(channelsMutex_);
+        if (!collected.empty()) {
+            std::shared_ptr<std::vector<jobject>> objects(
+                        new std::vector<jobject>(std::move(collected)),
+                        [] (std::vector<jobject> * objects) {
+                for (jobject o : *objects)
+                    jniEnv()->DeleteWeakGlobalRef(o);
+                delete objects;
+            });
+            for (JniChannel * c : channels_)
+                c->collected_.push_back(objects);
+        }
+        pending.swap(collected_);
     }
-    return it->second;
+    for (auto & objects : pending) {
+        for (jobject o : *objects)
+            Channel::deregisterObject(o);
+    }
+}
+
+JClassMap<JniMetaObject*> JniChannel::classMetas_;
+
+// Metas are keyed by class identity, so equally named classes from different
+// class loaders do not share one. Lookups don't lock, metas are never freed.
+JniMetaObject *JniChannel::metaObject2(jclass clazz) const
+{
+    JNIEnv * env = this->env();
+    static JniMetaObject * root = new JniObjectMetaObject(env);
+    jint hash = classMetas_.hash(env, clazz);
+    JniMetaObject ** meta = classMetas_.find(env, clazz, hash);
+    if (meta)
+        return *meta;
+    JLocalClassRef super(env, classClass(env).getSuperclass(clazz));
+    // java.lang.Object and interfaces
+    if (static_cast<jclass>(super) == nullptr)
+        return root;
+    JniMetaObject * m = new JniMetaObject(metaObject2(super), clazz);
+    meta = classMetas_.insert(env, clazz, hash, std::move(m));
+    if (*meta != m)
+        delete m;
+    return *meta;
+}
+
+ChannelClass::ChannelClass(JNIEnv *env)
+    : Class(env, "com/tal/hybridge/Channel")
+{
+    createUuid_ = env->GetMethodID(clazz_, "createUuid", "()Ljava/lang/String;");
+    startTimer_ = env->GetMethodID(clazz_, "startTimer", "(I)V");
+    stopTimer_ = env->GetMethodID(clazz_, "stopTimer", "()V");
+    declaredMembers_ = env->GetStaticMethodID(clazz_, "declaredMembers", "(Ljava/lang/Class;)[Ljava/lang/Object;");
+}
+
+std::string ChannelClass::createUuid(jobject channel)
+{
+    JLocalObjectRef uuid(env(), env()->CallObjectMethod(channel, createUuid_));
+    return JString(env(), uuid);
+}
+
+void ChannelClass::startTimer(jobject channel, jint msec)
+{
+    env()->CallVoidMethod(channel, startTimer_, msec);
+}
+
+void ChannelClass::stopTimer(jobject channel)
+{
+    env()->CallVoidMethod(channel, stopTimer_);
+}
+
+jobjectArray ChannelClass::declaredMembers(jclass clazz)
+{
+    return static_cast<jobjectArray>(env()->CallStaticObjectMethod(clazz_, declaredMembers_, clazz));
+}
+
+ChannelClass &channelClass(JNIEnv *env)
+{
+    static ChannelClass c(env);
+    return c;
 }
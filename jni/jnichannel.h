@@ -3,11 +3,18 @@
 
 #include <core/channel.h>
 
+#include "jniclass.h"
+
 #include <jni.h>
 
 #include <core/proxyobject.h>
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+
 class JniMetaObject;
+class JniTransport;
 
 class JniChannel : public Channel
 {
@@ -35,23 +42,63 @@ protected:
 
     void propertyChanged(jobject object, jstring property);
 
-    void connectTo(Transport *transport, jobject response);
+    void connectTo(JniTransport *transport, jobject response);
+
+    void disconnectFrom(JniTransport *transport);
+
+    void timerEvent();
+
+public:
+    // Number of registry buckets checked for collected objects on each
+    // registerObject/propertyChanged call and on each timer event
+    static void setSweepBudget(size_t perCall, size_t perTimer);
 
 protected:
     void invokeMethod(Object *object, jobject method, jobjectArray args, jobject response);
 
 private:
+    // Hands objects found collected to every channel, then deregisters the
+    // ones handed to this channel. Called with mutex_ held.
+    void sweepObjects(size_t budget);
+
     JniMetaObject * metaObject2(jclass clazz) const;
 
+    JNIEnv * env() const { return jniEnv(); }
+
 private:
     friend struct JChannel;
 
-    JNIEnv * env_;
+    // The core channel is not thread safe, every native entry that reaches
+    // it holds this lock. Shared with connected transports and proxies.
+    std::shared_ptr<std::recursive_mutex> mutex_;
     jobject handle_;
+    // Connected transports, batched over each timer event
+    std::vector<JniTransport*> transports_;
+    // Collected objects not yet deregistered here, guarded by channelsMutex_.
+    // The weak refs are deleted once every channel has dropped them.
+    std::vector<std::shared_ptr<std::vector<jobject>>> collected_;
+    static JClassMap<JniMetaObject*> classMetas_;
+    static std::vector<JniChannel*> channels_;
+    static std::mutex channelsMutex_;
+    static std::atomic<size_t> sweepPerCall_;
+    static std::atomic<size_t> sweepPerTimer_;
+};
+
+struct ChannelClass : Class
+{
+    ChannelClass(JNIEnv * env);
+    std::string createUuid(jobject channel);
+    void startTimer(jobject channel, jint msec);
+    void stopTimer(jobject channel);
+    // Channel.declaredMembers, local ref
+    jobjectArray declaredMembers(jclass clazz);
+private:
     jmethodID createUuid_;
     jmethodID startTimer_;
     jmethodID stopTimer_;
-    static std::map<std::string, JniMetaObject*> classMetas_;
+    jmethodID declaredMembers_;
 };
 
+ChannelClass & channelClass(JNIEnv * env = nullptr);
+
 #endif // JNICHANNEL_H
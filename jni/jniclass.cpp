@@ -2,31 +2,76 @@
 
 #include <stdexcept>
 
+static JavaVM * s_vm = nullptr;
+
+void setJavaVM(JavaVM *vm)
+{
+    s_vm = vm;
+}
+
+JavaVM *javaVM()
+{
+    return s_vm;
+}
+
+namespace {
+
+struct ThreadEnv
+{
+    JNIEnv * env = nullptr;
+    bool attached = false;
+    ~ThreadEnv()
+    {
+        if (attached)
+            s_vm->DetachCurrentThread();
+    }
+};
+
+}
+
+JNIEnv *jniEnv()
+{
+    static thread_local ThreadEnv t;
+    if (t.env == nullptr && s_vm) {
+        jint status = s_vm->GetEnv(reinterpret_cast<void**>(&t.env), JNI_VERSION_1_6);
+        if (status == JNI_EDETACHED) {
+            if (s_vm->AttachCurrentThread(&t.env, nullptr) == JNI_OK)
+                t.attached = true;
+            else
+                t.env = nullptr;
+        } else if (status != JNI_OK) {
+            t.env = nullptr;
+        }
+    }
+    return t.env;
+}
+
 Class::Class(JNIEnv *env, const char *className)
+    : clazz_(nullptr)
+    , init_(nullptr)
 {
-    env_ = env;
     if (className) {
-        clazz_ = env->FindClass(className);
-        clazz_ = static_cast<jclass>(env->NewGlobalRef(clazz_));
-    } else {
-        clazz_ = nullptr;
+        JLocalClassRef clazz(env, env->FindClass(className));
+        clazz_ = static_cast<jclass>(env->NewGlobalRef(clazz));
+        // interfaces and classes without a default constructor
+        init_ = env->GetMethodID(clazz_, "<init>", "()V");
+        if (init_ == nullptr)
+            env->ExceptionClear();
     }
 }
 
 Class::~Class()
 {
     if (clazz_)
-        env_->DeleteGlobalRef(clazz_);
+        env()->DeleteGlobalRef(clazz_);
 }
 
 jobject Class::newInstance()
 {
-    return env_->NewObject(clazz_,
-                           env_->GetMethodID(clazz_, "<init>", "()V"));
+    return env()->NewObject(clazz_, init_);
 }
 
 ClassClass::ClassClass(JNIEnv *env)
-    : env_(env)
 {
     jclass clazz = env->FindClass("java/lang/Class");
     isPrimitive_ = env->GetMethodID(clazz, "isPrimitive", "()Z");
@@ -38,6 +83,9 @@ ClassClass::ClassClass(JNIEnv *env)
     getDeclaredFields_ = env->GetMethodID(clazz, "getDeclaredFields", "()[Ljava/lang/reflect/Field;");
     getComponentType_ = env->GetMethodID(clazz, "getComponentType", "()Ljava/lang/Class;");
     getSuperclass_ = env->GetMethodID(clazz, "getSuperclass", "()Ljava/lang/Class;");
+    getClassLoader_ = env->GetMethodID(clazz, "getClassLoader", "()Ljava/lang/ClassLoader;");
+    classClass_ = static_cast<jclass>(env->NewGlobalRef(clazz));
+    forName_ = env->GetStaticMethodID(clazz, "forName", "(Ljava/lang/String;ZLjava/lang/ClassLoader;)Ljava/lang/Class;");
 
     clazz = env->FindClass("java/lang/Object");
     objectClass_ = static_cast<jclass>(env->NewGlobalRef(clazz));
@@ -48,76 +96,88 @@ ClassClass::ClassClass(JNIEnv *env)
 
 jboolean ClassClass::isPrimitive(jclass clazz) const
 {
-    return env_->CallBooleanMethod(clazz, isPrimitive_);
+    return env()->CallBooleanMethod(clazz, isPrimitive_);
 }
 
 jboolean ClassClass::isArray(jclass clazz) const
 {
-    return env_->CallBooleanMethod(clazz, isArray_);
+    return env()->CallBooleanMethod(clazz, isArray_);
 }
 
 jboolean ClassClass::isInstance(jclass clazz, jobject object) const
 {
-    return env_->CallBooleanMethod(clazz, isInstance_, object);
+    return env()->CallBooleanMethod(clazz, isInstance_, object);
 }
 
 jboolean ClassClass::isAssignableFrom(jclass clazz, jclass clazz2) const
 {
-    return env_->CallBooleanMethod(clazz, isAssignableFrom_, clazz2);
+    return env()->CallBooleanMethod(clazz, isAssignableFrom_, clazz2);
 }
 
 std::string ClassClass::getName(jclass clazz) const
 {
-    return JString(env_, env_->CallObjectMethod(clazz, getName_));
+    JLocalObjectRef name(env(), env()->CallObjectMethod(clazz, getName_));
+    return JString(env(), name);
 }
 
 std::vector<jobject> ClassClass::getDeclaredMethods(jclass clazz) const
 {
-    jobjectArray methods = static_cast<jobjectArray>(
-                env_->CallObjectMethod(clazz, getDeclaredMethods_));
-    int n = env_->GetArrayLength(methods);
+    JLocalRef<jobjectArray> methods(env(), static_cast<jobjectArray>(
+                env()->CallObjectMethod(clazz, getDeclaredMethods_)));
+    int n = env()->GetArrayLength(methods);
     std::vector<jobject> methods2;
     for (int i = 0; i < n; ++i) {
-        methods2.push_back(env_->GetObjectArrayElement(methods, i));
+        methods2.push_back(env()->GetObjectArrayElement(methods, i));
     }
     return methods2;
 }
 
 std::vector<jobject> ClassClass::getDeclaredFields(jclass clazz) const
 {
-    jobjectArray fields = static_cast<jobjectArray>(
-                env_->CallObjectMethod(clazz, getDeclaredFields_));
-    int n = env_->GetArrayLength(fields);
+    JLocalRef<jobjectArray> fields(env(), static_cast<jobjectArray>(
+                env()->CallObjectMethod(clazz, getDeclaredFields_)));
+    int n = env()->GetArrayLength(fields);
     std::vector<jobject> fields2;
     for (int i = 0; i < n; ++i) {
-        fields2.push_back(env_->GetObjectArrayElement(fields, i));
+        fields2.push_back(env()->GetObjectArrayElement(fields, i));
     }
     return fields2;
 }
 
 jclass ClassClass::getComponentType(jclass clazz) const
 {
-    return static_cast<jclass>(env_->CallObjectMethod(clazz, getComponentType_));
+    return static_cast<jclass>(env()->CallObjectMethod(clazz, getComponentType_));
 }
 
 jclass ClassClass::getSuperclass(jclass clazz) const
 {
-    return static_cast<jclass>(env_->CallObjectMethod(clazz, getSuperclass_));
+    return static_cast<jclass>(env()->CallObjectMethod(clazz, getSuperclass_));
+}
+
+jobject ClassClass::getClassLoader(jclass clazz) const
+{
+    return env()->CallObjectMethod(clazz, getClassLoader_);
+}
+
+jclass ClassClass::forName(const std::string &name, jobject loader) const
+{
+    JLocalObjectRef jname(env(), newUtf8String(env(), name));
+    return static_cast<jclass>(env()->CallStaticObjectMethod(classClass_, forName_,
+                                                             static_cast<jobject>(jname), JNI_FALSE, loader));
 }
 
 jclass ClassClass::getClass(jobject object) const
 {
-    return static_cast<jclass>(env_->CallObjectMethod(object, getClass_));
+    return static_cast<jclass>(env()->CallObjectMethod(object, getClass_));
 }
 
 std::string ClassClass::toString(jobject object) const
 {
-    JLocalObjectRef string(env_, env_->CallObjectMethod(object, toString_));
-    return JString(env_, string);
+    JLocalObjectRef string(env(), env()->CallObjectMethod(object, toString_));
+    return JString(env(), string);
 }
 
 MemberClass::MemberClass(JNIEnv *env)
-	: env_(env)
 {
     jclass clazz = env->FindClass("java/lang/reflect/Member");
     getName_ = env->GetMethodID(clazz, "getName", "()Ljava/lang/String;");
@@ -127,17 +187,18 @@ MemberClass::MemberClass(JNIEnv *env)
 
 std::string MemberClass::getName(jobject member) const
 {
-    return JString(env_, env_->CallObjectMethod(member, getName_));
+    JLocalObjectRef name(env(), env()->CallObjectMethod(member, getName_));
+    return JString(env(), name);
 }
 
 jint MemberClass::getModifiers(jobject member) const
 {
-    return env_->CallIntMethod(member, getModifiers_);
+    return env()->CallIntMethod(member, getModifiers_);
 }
 
 jclass MemberClass::getDeclaringClass(jobject member) const
 {
-    return static_cast<jclass>(env_->CallObjectMethod(member, getDeclaringClass_));
+    return static_cast<jclass>(env()->CallObjectMethod(member, getDeclaringClass_));
 }
 
 MethodClass::MethodClass(JNIEnv *env)
@@ -153,41 +214,47 @@ MethodClass::MethodClass(JNIEnv *env)
 
 jclass MethodClass::getReturnType(jobject method) const
 {
-    return static_cast<jclass>(env_->CallObjectMethod(method, getReturnType_));
+    return static_cast<jclass>(env()->CallObjectMethod(method, getReturnType_));
 }
 
 jint MethodClass::getParameterCount(jobject method) const
 {
-    return env_->CallIntMethod(method, getParameterCount_);
+    return env()->CallIntMethod(method, getParameterCount_);
 }
 
 jobjectArray MethodClass::getParameterTypes(jobject method) const
 {
-    return static_cast<jobjectArray>(env_->CallObjectMethod(method, getParameterTypes_));
+    return static_cast<jobjectArray>(env()->CallObjectMethod(method, getParameterTypes_));
 }
 
 jobject MethodClass::invoke(jobject method, jobject object, jobjectArray args) const
 {
-    return env_->CallObjectMethod(method, invoke_, object, args);
+    return env()->CallObjectMethod(method, invoke_, object, args);
 }
 
 FieldClass::FieldClass(JNIEnv *env)
     : MemberClass(env)
 {
     jclass clazz = env->FindClass("java/lang/reflect/Field");
+    getType_ = env->GetMethodID(clazz, "getType", "()Ljava/lang/Class;");
     get_ = env->GetMethodID(clazz, "get", "(Ljava/lang/Object;)Ljava/lang/Object;");
     set_ = env->GetMethodID(clazz, "set", "(Ljava/lang/Object;Ljava/lang/Object;)V");
     JThrowable::check(env);
 }
 
+jclass FieldClass::getType(jobject field) const
+{
+    return static_cast<jclass>(env()->CallObjectMethod(field, getType_));
+}
+
 jobject FieldClass::get(jobject field, jobject object) const
 {
-    return env_->CallObjectMethod(field, get_, object);
+    return env()->CallObjectMethod(field, get_, object);
 }
 
 void FieldClass::set(jobject field, jobject object, jobject value) const
 {
-    env_->CallObjectMethod(field, set_, object, value);
+    env()->CallObjectMethod(field, set_, object, value);
 }
 
 ClassClass &classClass(JNIEnv *env)
@@ -230,7 +297,6 @@ bool JThrowable::clear(JNIEnv *env)
 }
 
 JThrowable::JThrowable(JNIEnv *env)
-    : env_(env)
 {
     jclass clazz = env->FindClass("java/lang/Throwable");
     getMessage_ = env->GetMethodID(clazz, "getMessage", "()Ljava/lang/String;");
@@ -239,42 +305,45 @@ JThrowable::JThrowable(JNIEnv *env)
 
 jstring JThrowable::getMessage(jthrowable e) const
 {
-    return static_cast<jstring>(env_->CallObjectMethod(e, getMessage_));
+    return static_cast<jstring>(env()->CallObjectMethod(e, getMessage_));
 }
 
 void JThrowable::printStackTrace(jthrowable e) const
 {
-    env_->CallVoidMethod(e, printStackTrace_);
+    env()->CallVoidMethod(e, printStackTrace_);
 }
 
 ModifierClass::ModifierClass(JNIEnv *env)
-    : env_(env)
 {
-    jclass clazz = env->FindClass("java/lang/reflect/Modifier");
-    clazz_ = static_cast<jclass>(env->NewGlobalRef(clazz));
-    isPublic_ = env->GetStaticMethodID(clazz, "isPublic", "(I)Z");
-    isStatic_ = env->GetStaticMethodID(clazz, "isStatic", "(I)Z");
-    isAbstract_ = env->GetStaticMethodID(clazz, "isAbstract", "(I)Z");
+    JLocalClassRef clazz(env, env->FindClass("java/lang/reflect/Modifier"));
+    public_ = env->GetStaticIntField(clazz, env->GetStaticFieldID(clazz, "PUBLIC", "I"));
+    static_ = env->GetStaticIntField(clazz, env->GetStaticFieldID(clazz, "STATIC", "I"));
+    abstract_ = env->GetStaticIntField(clazz, env->GetStaticFieldID(clazz, "ABSTRACT", "I"));
+    final_ = env->GetStaticIntField(clazz, env->GetStaticFieldID(clazz, "FINAL", "I"));
     JThrowable::check(env);
 }
 
-jboolean ModifierClass::isPublic(int mod) const
+ModifierClass &modifierClass(JNIEnv *env)
 {
-    return env_->CallStaticBooleanMethod(clazz_, isPublic_, mod);
+    static ModifierClass clazz(env);
+    return clazz;
 }
 
-jboolean ModifierClass::isStatic(int mod) const
+SystemClass::SystemClass(JNIEnv *env)
 {
-    return env_->CallStaticBooleanMethod(clazz_, isStatic_, mod);
+    jclass clazz = env->FindClass("java/lang/System");
+    clazz_ = static_cast<jclass>(env->NewGlobalRef(clazz));
+    identityHashCode_ = env->GetStaticMethodID(clazz, "identityHashCode", "(Ljava/lang/Object;)I");
+    JThrowable::check(env);
 }
 
-jboolean ModifierClass::isAbstract(int mod) const
+jint SystemClass::identityHashCode(jobject object) const
 {
-    return env_->CallStaticBooleanMethod(clazz_, isAbstract_, mod);
+    return env()->CallStaticIntMethod(clazz_, identityHashCode_, object);
 }
 
-ModifierClass &modifierClass(JNIEnv *env)
+SystemClass &systemClass(JNIEnv *env)
 {
-    static ModifierClass clazz(env);
+    static SystemClass clazz(env);
     return clazz;
 }
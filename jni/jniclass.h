@@ -1,29 +1,44 @@
 #ifndef JNIINFO_H
 #define JNIINFO_H
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <type_traits>
 #include <vector>
 
+#include "jniutf.h"
+
 #include <jni.h>
 
 struct MethodClass;
 struct FieldClass;
 
+// Set once in JNI_OnLoad
+void setJavaVM(JavaVM * vm);
+
+JavaVM * javaVM();
+
+// JNIEnv of the calling thread. Threads not known to the VM are attached on
+// first use and detached again when they exit.
+JNIEnv * jniEnv();
+
 struct Class
 {
 public:
     Class(JNIEnv *env, char const * className = nullptr);
     virtual ~Class();
-    JNIEnv *env() const { return env_; }
+    JNIEnv *env() const { return jniEnv(); }
     jclass clazz() const { return clazz_; }
     jobject newInstance();
     friend bool operator==(Class const & l, jclass const & r)
     {
-        return l.env_->IsSameObject(l.clazz_, r);
+        return l.env()->IsSameObject(l.clazz_, r);
     }
 protected:
-    JNIEnv *env_;
     jclass clazz_;
+    jmethodID init_;
 };
 
 struct ClassClass
@@ -39,13 +54,16 @@ struct ClassClass
     std::vector<jobject> getDeclaredFields(jclass clazz) const;
     jclass getComponentType(jclass clazz) const;
     jclass getSuperclass(jclass clazz) const;
+    jobject getClassLoader(jclass clazz) const;
+    // Class.forName without initializing the class
+    jclass forName(std::string const & name, jobject loader) const;
 
     jclass objectClass() const { return objectClass_; }
     jclass getClass(jobject object) const;
     std::string toString(jobject object) const;
 
 private:
-    JNIEnv * env_;
+    JNIEnv * env() const { return jniEnv(); }
     jmethodID isPrimitive_;
     jmethodID isArray_;
     jmethodID isInstance_;
@@ -55,6 +73,9 @@ private:
     jmethodID getDeclaredFields_;
     jmethodID getComponentType_;
     jmethodID getSuperclass_;
+    jmethodID getClassLoader_;
+    jclass classClass_;
+    jmethodID forName_;
 
     // methods of Object
     jclass objectClass_;
@@ -70,7 +91,7 @@ struct MemberClass
     jclass getDeclaringClass(jobject member) const;
 
 protected:
-    JNIEnv * env_;
+    JNIEnv * env() const { return jniEnv(); }
 protected:
     jmethodID getName_;
     jmethodID getModifiers_;
@@ -95,27 +116,41 @@ private:
 struct FieldClass : MemberClass
 {
     FieldClass(JNIEnv *env);
+    jclass getType(jobject field) const;
     jobject get(jobject field, jobject object) const;
     void set(jobject field, jobject object, jobject value) const;
 
 private:
+    jmethodID getType_;
     jmethodID get_;
     jmethodID set_;
 };
 
+// Tests modifier bits natively, the masks are read once from Modifier
 struct ModifierClass
 {
     ModifierClass(JNIEnv *env);
-    jboolean isPublic(int mod) const;
-    jboolean isStatic(int mod) const;
-    jboolean isAbstract(int mod) const;
+    jboolean isPublic(int mod) const { return (mod & public_) != 0; }
+    jboolean isStatic(int mod) const { return (mod & static_) != 0; }
+    jboolean isAbstract(int mod) const { return (mod & abstract_) != 0; }
+    jboolean isFinal(int mod) const { return (mod & final_) != 0; }
 
 private:
-    JNIEnv * env_;
+    jint public_;
+    jint static_;
+    jint abstract_;
+    jint final_;
+};
+
+struct SystemClass
+{
+    SystemClass(JNIEnv *env);
+    jint identityHashCode(jobject object) const;
+
+private:
+    JNIEnv * env() const { return jniEnv(); }
     jclass clazz_;
-    jmethodID isPublic_;
-    jmethodID isStatic_;
-    jmethodID isAbstract_;
+    jmethodID identityHashCode_;
 };
 
 ClassClass & classClass(JNIEnv *env = nullptr);
@@ -126,6 +161,8 @@ MethodClass & methodClass(JNIEnv *env = nullptr);
 
 ModifierClass & modifierClass(JNIEnv *env = nullptr);
 
+SystemClass & systemClass(JNIEnv *env = nullptr);
+
 struct JThrowable
 {
 public:
@@ -137,7 +174,7 @@ public:
     void printStackTrace(jthrowable e) const;
 
 private:
-    JNIEnv * env_;
+    JNIEnv * env() const { return jniEnv(); }
     jmethodID getMessage_;
     jmethodID printStackTrace_;
 };
@@ -155,13 +192,85 @@ private:
     jobject target_;
 };
 
+// Maps classes by identity to T. Keys are weak global refs bucketed by
+// System.identityHashCode; entries are never removed, so lookups walk the
+// buckets without locking while other threads insert.
+template <typename T>
+class JClassMap
+{
+    struct Node
+    {
+        jint hash;
+        jweak clazz;
+        T value;
+        Node * next;
+    };
+
+    enum { BucketCount = 256 };
+
+public:
+    JClassMap()
+    {
+        for (auto & b : buckets_)
+            b.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~JClassMap()
+    {
+        for (auto & b : buckets_) {
+            Node * n = b.load(std::memory_order_relaxed);
+            while (n) {
+                Node * next = n->next;
+                delete n;
+                n = next;
+            }
+        }
+    }
+
+    static jint hash(JNIEnv * env, jclass clazz)
+    {
+        return systemClass(env).identityHashCode(clazz);
+    }
+
+    T * find(JNIEnv * env, jclass clazz, jint hash) const
+    {
+        Node * n = buckets_[static_cast<unsigned>(hash) % BucketCount].load(std::memory_order_acquire);
+        for (; n; n = n->next) {
+            if (n->hash == hash && env->IsSameObject(n->clazz, clazz))
+                return &n->value;
+        }
+        return nullptr;
+    }
+
+    // Returns the existing value if another thread inserted clazz first
+    T * insert(JNIEnv * env, jclass clazz, jint hash, T && value)
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        T * v = find(env, clazz, hash);
+        if (v)
+            return v;
+        std::atomic<Node *> & bucket = buckets_[static_cast<unsigned>(hash) % BucketCount];
+        Node * n = new Node{hash, env->NewWeakGlobalRef(clazz), std::move(value),
+                bucket.load(std::memory_order_relaxed)};
+        bucket.store(n, std::memory_order_release);
+        return &n->value;
+    }
+
+private:
+    std::mutex mutex_;
+    std::atomic<Node *> buckets_[BucketCount];
+};
+
 template <typename T>
 class JLocalRef
 {
 public:
     JLocalRef(JNIEnv *env, T target) : env_(env), target_(target) {}
-    ~JLocalRef() { env_->DeleteLocalRef(target_); }
+    JLocalRef(JLocalRef const &) = delete;
+    JLocalRef & operator=(JLocalRef const &) = delete;
+    ~JLocalRef() { if (target_) env_->DeleteLocalRef(target_); }
     operator T() { return target_; }
+    T release() { T t = target_; target_ = nullptr; return t; }
 private:
     JNIEnv *env_;
     T target_;
@@ -170,32 +279,58 @@ private:
 typedef JLocalRef<jobject> JLocalObjectRef;
 typedef JLocalRef<jclass> JLocalClassRef;
 
+// Global ref for callbacks that run later, maybe on another thread. Deleted
+// with the last copy, also when the callback never runs.
+typedef std::shared_ptr<std::remove_pointer<jobject>::type> JSharedRef;
+
+inline JSharedRef newSharedRef(JNIEnv *env, jobject object)
+{
+    return JSharedRef(env->NewGlobalRef(object), [] (jobject ref) {
+        if (ref)
+            jniEnv()->DeleteGlobalRef(ref);
+    });
+}
+
+// Frees all local refs created in its scope, except the one passed to pop()
+class JLocalFrame
+{
+public:
+    JLocalFrame(JNIEnv *env, jint capacity = 16) : env_(env) { env_->PushLocalFrame(capacity); }
+    JLocalFrame(JLocalFrame const &) = delete;
+    JLocalFrame & operator=(JLocalFrame const &) = delete;
+    ~JLocalFrame() { if (env_) env_->PopLocalFrame(nullptr); }
+    jobject pop(jobject result)
+    {
+        JNIEnv * env = env_;
+        env_ = nullptr;
+        return env->PopLocalFrame(result);
+    }
+private:
+    JNIEnv *env_;
+};
+
+// Standard UTF-8 copy of a java string, see jniutf.h
 class JString
 {
 public:
     JString(JNIEnv *env, jobject jstr)
-        : env_(env)
-        , jstr_(static_cast<jstring>(jstr))
+        : str_(utf8String(env, static_cast<jstring>(jstr)))
     {
-        jboolean isCopy;
-        str_ = env_->GetStringUTFChars(jstr_, &isCopy);
     }
-    ~JString()
+    operator std::string() const &
     {
-        env_->ReleaseStringUTFChars(jstr_, str_);
+        return str_;
     }
-    operator std::string() const
+    operator std::string() &&
     {
-        return str_;
+        return std::move(str_);
     }
     char const * str() const
     {
-        return str_;
+        return str_.c_str();
     }
 private:
-    JNIEnv *env_;
-    jstring jstr_;
-    char const * str_;
+    std::string str_;
 };
 
 #endif // JNIINFO_H
@@ -0,0 +1,227 @@
+#ifndef JNIHANDLETABLE_H
+#define JNIHANDLETABLE_H
+
+#include <atomic>
+#include <cstdint>
+
+#include <jni.h>
+
+/*
+ * Maps objects to generation tagged 64 bit handles for the java side.
+ *
+ * A handle is (generation << 32) | index. Lookup is wait-free: it bumps the
+ * reference count of the slot and then checks the generation, so no lock is
+ * shared between unrelated handles. Freed slots are kept on a lock-free list
+ * and reused in O(1); reusing a slot bumps its generation, so stale handles
+ * are still rejected.
+ */
+template <typename T>
+class JniHandleTable
+{
+    enum : uint64_t
+    {
+        Live = uint64_t(1) << 31,
+        Free = uint64_t(1) << 30,
+        RefMask = Free - 1,
+    };
+
+    struct Slot
+    {
+        // generation (high 32 bits) | live | free | reference count
+        std::atomic<uint64_t> state;
+        std::atomic<uint32_t> next;
+        uint32_t index;
+        T * object;
+    };
+
+    enum : uint32_t
+    {
+        ChunkBits = 8,
+        ChunkSize = 1 << ChunkBits,
+        MaxChunks = 1024,
+    };
+
+public:
+    class Ref
+    {
+    public:
+        Ref(JniHandleTable * table = nullptr, Slot * slot = nullptr) : table_(table), slot_(slot) {}
+        Ref(Ref && o) : table_(o.table_), slot_(o.slot_) { o.slot_ = nullptr; }
+        Ref(Ref const &) = delete;
+        ~Ref() { if (slot_) table_->release(slot_); }
+        Ref & operator=(Ref const &) = delete;
+        T * get() const { return slot_ ? slot_->object : nullptr; }
+        T * operator->() const { return slot_->object; }
+        explicit operator bool() const { return slot_ != nullptr; }
+    private:
+        JniHandleTable * table_;
+        Slot * slot_;
+    };
+
+public:
+    JniHandleTable()
+        : size_(0)
+        , free_(0)
+    {
+        for (auto & c : chunks_)
+            c.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~JniHandleTable()
+    {
+        clear();
+        for (auto & c : chunks_)
+            delete [] c.load(std::memory_order_relaxed);
+    }
+
+    // Takes ownership of object, returns 0 when the table is full
+    jlong create(T * object)
+    {
+        uint32_t index;
+        Slot * slot = allocate(index);
+        if (slot == nullptr) {
+            delete object;
+            return 0;
+        }
+        slot->object = object;
+        // keep transient counts of stale lookups that raced with us
+        uint64_t s = slot->state.fetch_add(Live + 1 - Free, std::memory_order_acq_rel);
+        return static_cast<jlong>((s & ~uint64_t(0xffffffff)) | index);
+    }
+
+    Ref get(jlong handle)
+    {
+        Slot * slot = find(handle);
+        if (slot == nullptr)
+            return Ref();
+        uint64_t s = slot->state.fetch_add(1, std::memory_order_acquire);
+        if ((s >> 32) != (static_cast<uint64_t>(handle) >> 32) || (s & Live) == 0) {
+            release(slot);
+            return Ref();
+        }
+        return Ref(this, slot);
+    }
+
+    // The object is destroyed when the last outstanding Ref goes away
+    bool remove(jlong handle)
+    {
+        Slot * slot = find(handle);
+        if (slot == nullptr)
+            return false;
+        uint64_t s = slot->state.load(std::memory_order_relaxed);
+        do {
+            if ((s >> 32) != (static_cast<uint64_t>(handle) >> 32) || (s & Live) == 0)
+                return false;
+        } while (!slot->state.compare_exchange_weak(s, s & ~uint64_t(Live), std::memory_order_acq_rel));
+        release(slot);
+        return true;
+    }
+
+    void clear()
+    {
+        uint32_t n = size_.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < n; ++i) {
+            Slot * slot = at(i);
+            if (slot == nullptr)
+                continue;
+            uint64_t s = slot->state.load(std::memory_order_acquire);
+            if (s & Live)
+                remove(static_cast<jlong>((s & ~uint64_t(0xffffffff)) | i));
+        }
+    }
+
+private:
+    Slot * at(uint32_t index) const
+    {
+        Slot * chunk = chunks_[index >> ChunkBits].load(std::memory_order_acquire);
+        return chunk ? chunk + (index & (ChunkSize - 1)) : nullptr;
+    }
+
+    Slot * find(jlong handle) const
+    {
+        uint32_t index = static_cast<uint32_t>(handle);
+        if (index >= size_.load(std::memory_order_acquire))
+            return nullptr;
+        return at(index);
+    }
+
+    void release(Slot * slot)
+    {
+        uint64_t s = slot->state.fetch_sub(1, std::memory_order_acq_rel) - 1;
+        // Stale lookups may bump and drop the count of a dead slot as well,
+        // only the one that moves it to the next generation reclaims it.
+        while ((s & (Live | Free | RefMask)) == 0) {
+            uint64_t n = ((s >> 32) + 1) << 32;
+            if (n == 0)
+                n = uint64_t(1) << 32;
+            n |= Free;
+            if (slot->state.compare_exchange_weak(s, n, std::memory_order_acq_rel)) {
+                T * object = slot->object;
+                slot->object = nullptr;
+                delete object;
+                push(slot);
+                break;
+            }
+        }
+    }
+
+    Slot * allocate(uint32_t & index)
+    {
+        Slot * slot = pop(index);
+        if (slot)
+            return slot;
+        index = size_.load(std::memory_order_relaxed);
+        do {
+            if (index >= ChunkSize * MaxChunks)
+                return nullptr;
+        } while (!size_.compare_exchange_weak(index, index + 1, std::memory_order_acq_rel));
+        std::atomic<Slot *> & chunk = chunks_[index >> ChunkBits];
+        if (chunk.load(std::memory_order_acquire) == nullptr) {
+            Slot * c = new Slot[ChunkSize];
+            for (uint32_t i = 0; i < ChunkSize; ++i) {
+                c[i].state.store((uint64_t(1) << 32) | Free, std::memory_order_relaxed);
+                c[i].next.store(0, std::memory_order_relaxed);
+                c[i].index = (index & ~uint32_t(ChunkSize - 1)) + i;
+                c[i].object = nullptr;
+            }
+            Slot * expected = nullptr;
+            if (!chunk.compare_exchange_strong(expected, c, std::memory_order_acq_rel))
+                delete [] c;
+        }
+        return at(index);
+    }
+
+    // free list head: tag (high 32 bits) | index + 1, tag avoids ABA
+    void push(Slot * slot)
+    {
+        uint32_t index = slot->index;
+        uint64_t h = free_.load(std::memory_order_relaxed);
+        uint64_t n;
+        do {
+            slot->next.store(static_cast<uint32_t>(h), std::memory_order_relaxed);
+            n = (((h >> 32) + 1) << 32) | (index + 1);
+        } while (!free_.compare_exchange_weak(h, n, std::memory_order_acq_rel));
+    }
+
+    Slot * pop(uint32_t & index)
+    {
+        uint64_t h = free_.load(std::memory_order_acquire);
+        uint64_t n;
+        Slot * slot;
+        do {
+            if (static_cast<uint32_t>(h) == 0)
+                return nullptr;
+            index = static_cast<uint32_t>(h) - 1;
+            slot = at(index);
+            n = (((h >> 32) + 1) << 32) | slot->next.load(std::memory_order_relaxed);
+        } while (!free_.compare_exchange_weak(h, n, std::memory_order_acq_rel));
+        return slot;
+    }
+
+private:
+    std::atomic<uint32_t> size_;
+    std::atomic<uint64_t> free_;
+    std::atomic<Slot *> chunks_[MaxChunks];
+};
+
+#endif // JNIHANDLETABLE_H
@@ -0,0 +1,556 @@
+#include "jnijson.h"
+#include "jniutf.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define JNIJSON_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define JNIJSON_NEON
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Nesting deeper than this is rejected instead of overflowing the stack
+enum { MaxDepth = 256 };
+
+static char const hexDigits[] = "0123456789abcdef";
+
+static inline unsigned firstBit(unsigned mask)
+{
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return static_cast<unsigned>(i);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+static void writeInteger(long long n, JniOutput & out)
+{
+    char buf[24];
+    char * p = buf + sizeof(buf);
+    unsigned long long u = n < 0 ? 0ULL - static_cast<unsigned long long>(n)
+                                 : static_cast<unsigned long long>(n);
+    do {
+        *--p = static_cast<char>('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (n < 0)
+        *--p = '-';
+    out.append(p, static_cast<size_t>(buf + sizeof(buf) - p));
+}
+
+// Floats are read back as float, otherwise 0.1f never matches at 7 digits
+static void writeNumber(double d, int precision, bool single, JniOutput & out)
+{
+    if (!std::isfinite(d)) {
+        out.append("null", 4);
+        return;
+    }
+    // shortest of the two precisions that reads back the same
+    char buf[32];
+    int n = std::snprintf(buf, sizeof(buf), "%.*g", precision - 2, d);
+    bool same = single ? std::strtof(buf, nullptr) == static_cast<float>(d)
+                       : std::strtod(buf, nullptr) == d;
+    if (!same)
+        n = std::snprintf(buf, sizeof(buf), "%.*g", precision, d);
+    out.append(buf, static_cast<size_t>(n));
+}
+
+static void writeString(std::string const & s, JniOutput & out)
+{
+    out.push_back('"');
+    char const * run = s.data();
+    char const * end = run + s.size();
+    for (char const * p = run; p < end; ++p) {
+        unsigned char c = static_cast<unsigned char>(*p);
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        out.append(run, static_cast<size_t>(p - run));
+        run = p + 1;
+        switch (c) {
+        case '"': out.append("\\\"", 2); break;
+        case '\\': out.append("\\\\", 2); break;
+        case '\b': out.append("\\b", 2); break;
+        case '\f': out.append("\\f", 2); break;
+        case '\n': out.append("\\n", 2); break;
+        case '\r': out.append("\\r", 2); break;
+        case '\t': out.append("\\t", 2); break;
+        default: {
+            char esc[6] = {'\\', 'u', '0', '0', hexDigits[c >> 4], hexDigits[c & 0xf]};
+            out.append(esc, 6);
+        }
+        }
+    }
+    out.append(run, static_cast<size_t>(end - run));
+    out.push_back('"');
+}
+
+void writeJson(const Value &value, JniOutput &out)
+{
+    switch (value.type()) {
+    case Value::Bool:
+        if (value.toBool())
+            out.append("true", 4);
+        else
+            out.append("false", 5);
+        break;
+    case Value::Int:
+        writeInteger(value.toInt(), out);
+        break;
+    case Value::Long:
+        writeInteger(value.toLong(), out);
+        break;
+    case Value::Float:
+        writeNumber(static_cast<double>(value.toFloat()), 9, true, out);
+        break;
+    case Value::Double:
+        writeNumber(value.toDouble(), 17, false, out);
+        break;
+    case Value::String:
+        writeString(value.toString(), out);
+        break;
+    case Value::Array_: {
+        out.push_back('[');
+        bool first = true;
+        for (Value const & v : value.toArray()) {
+            if (!first)
+                out.push_back(',');
+            first = false;
+            writeJson(v, out);
+        }
+        out.push_back(']');
+        break;
+    }
+    case Value::Map_: {
+        out.push_back('{');
+        bool first = true;
+        for (auto const & e : value.toMap()) {
+            if (!first)
+                out.push_back(',');
+            first = false;
+            writeString(e.first, out);
+            out.push_back(':');
+            writeJson(e.second, out);
+        }
+        out.push_back('}');
+        break;
+    }
+    default:
+        out.append("null", 4);
+        break;
+    }
+}
+
+// Length of the leading run of string units that need no attention,
+// i.e. no quote, backslash or control character
+static inline size_t plainRun(char const * p, size_t n)
+{
+    size_t i = 0;
+#if defined(JNIJSON_SSE2)
+    __m128i const quote = _mm_set1_epi8('"');
+    __m128i const backslash = _mm_set1_epi8('\\');
+    __m128i const control = _mm_set1_epi8(0x1f);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                 _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+        if (int mask = _mm_movemask_epi8(m))
+            return i + firstBit(static_cast<unsigned>(mask));
+    }
+#elif defined(JNIJSON_NEON)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<uint8_t const *>(p + i));
+        uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\'))),
+                                vcltq_u8(v, vdupq_n_u8(0x20)));
+        if (vmaxvq_u8(m))
+            break;
+    }
+#endif
+    for (; i < n; ++i) {
+        unsigned char c = static_cast<unsigned char>(p[i]);
+        if (c == '"' || c == '\\' || c < 0x20)
+            break;
+    }
+    return i;
+}
+
+static inline size_t plainRun(jchar const * p, size_t n)
+{
+    size_t i = 0;
+#if defined(JNIJSON_SSE2)
+    __m128i const quote = _mm_set1_epi16('"');
+    __m128i const backslash = _mm_set1_epi16('\\');
+    __m128i const control = _mm_set1_epi16(static_cast<short>(0xffe0));
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(v, quote), _mm_cmpeq_epi16(v, backslash)),
+                                 _mm_cmpeq_epi16(_mm_and_si128(v, control), _mm_setzero_si128()));
+        if (int mask = _mm_movemask_epi8(m))
+            return i + firstBit(static_cast<unsigned>(mask)) / 2;
+    }
+#elif defined(JNIJSON_NEON)
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t v = vld1q_u16(p + i);
+        uint16x8_t m = vorrq_u16(vorrq_u16(vceqq_u16(v, vdupq_n_u16('"')), vceqq_u16(v, vdupq_n_u16('\\'))),
+                                 vcltq_u16(v, vdupq_n_u16(0x20)));
+        if (vmaxvq_u16(m))
+            break;
+    }
+#endif
+    for (; i < n; ++i) {
+        jchar c = p[i];
+        if (c == '"' || c == '\\' || c < 0x20)
+            break;
+    }
+    return i;
+}
+
+static inline void appendPlain(char const * p, size_t n, std::string & s)
+{
+    s.append(p, n);
+}
+
+static inline void appendPlain(jchar const * p, size_t n, std::string & s)
+{
+    size_t size = s.size();
+    s.resize(size + n * 3);
+    s.resize(size + utf16ToUtf8(p, n, &s[size]));
+}
+
+namespace {
+
+// Builds the Value tree in one pass over UTF-8 bytes or UTF-16 units.
+// Keys and strings are decoded once into their final std::string and
+// moved into the tree.
+template<typename Char>
+class JsonReader
+{
+public:
+    JsonReader(Char const * data, size_t size)
+        : p_(data)
+        , end_(data + size)
+    {
+    }
+
+    bool document(Value & value)
+    {
+        if (!parse(value, 0))
+            return false;
+        skipSpace();
+        return p_ == end_;
+    }
+
+private:
+    void skipSpace()
+    {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\n' || *p_ == '\r' || *p_ == '\t'))
+            ++p_;
+    }
+
+    bool literal(char const * word, size_t n)
+    {
+        if (static_cast<size_t>(end_ - p_) < n)
+            return false;
+        for (size_t i = 0; i < n; ++i) {
+            if (p_[i] != static_cast<Char>(word[i]))
+                return false;
+        }
+        p_ += n;
+        return true;
+    }
+
+    bool parse(Value & value, int depth)
+    {
+        skipSpace();
+        if (p_ == end_ || depth > MaxDepth)
+            return false;
+        switch (*p_) {
+        case '{':
+            return parseMap(value, depth);
+        case '[':
+            return parseArray(value, depth);
+        case '"': {
+            std::string s;
+            if (!parseString(s))
+                return false;
+            value = Value(std::move(s));
+            return true;
+        }
+        case 't':
+            if (!literal("true", 4))
+                return false;
+            value = Value(true);
+            return true;
+        case 'f':
+            if (!literal("false", 5))
+                return false;
+            value = Value(false);
+            return true;
+        case 'n':
+            if (!literal("null", 4))
+                return false;
+            value = Value();
+            return true;
+        default:
+            return parseNumber(value);
+        }
+    }
+
+    bool parseMap(Value & value, int depth)
+    {
+        Map map;
+        ++p_;
+        skipSpace();
+        if (p_ < end_ && *p_ == '}') {
+            ++p_;
+            value = Value(std::move(map));
+            return true;
+        }
+        while (true) {
+            skipSpace();
+            std::string key;
+            if (p_ == end_ || *p_ != '"' || !parseString(key))
+                return false;
+            skipSpace();
+            if (p_ == end_ || *p_ != ':')
+                return false;
+            ++p_;
+            // keys mostly come sorted, a duplicate key gets the later value
+            Map::iterator it = map.emplace_hint(map.end(), std::move(key), Value());
+            if (!parse(it->second, depth + 1))
+                return false;
+            skipSpace();
+            if (p_ == end_)
+                return false;
+            if (*p_ == '}')
+                break;
+            if (*p_++ != ',')
+                return false;
+        }
+        ++p_;
+        value = Value(std::move(map));
+        return true;
+    }
+
+    bool parseArray(Value & value, int depth)
+    {
+        Array array;
+        ++p_;
+        skipSpace();
+        if (p_ < end_ && *p_ == ']') {
+            ++p_;
+            value = Value(std::move(array));
+            return true;
+        }
+        while (true) {
+            array.emplace_back();
+            if (!parse(array.back(), depth + 1))
+                return false;
+            skipSpace();
+            if (p_ == end_)
+                return false;
+            if (*p_ == ']')
+                break;
+            if (*p_++ != ',')
+                return false;
+        }
+        ++p_;
+        value = Value(std::move(array));
+        return true;
+    }
+
+    bool hex4(uint32_t & u)
+    {
+        if (end_ - p_ < 4)
+            return false;
+        u = 0;
+        for (int i = 0; i < 4; ++i) {
+            Char c = *p_++;
+            u <<= 4;
+            if (c >= '0' && c <= '9')
+                u |= static_cast<uint32_t>(c - '0');
+            else if (c >= 'a' && c <= 'f')
+                u |= static_cast<uint32_t>(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F')
+                u |= static_cast<uint32_t>(c - 'A' + 10);
+            else
+                return false;
+        }
+        return true;
+    }
+
+    static void appendUtf8(uint32_t c, std::string & s)
+    {
+        if (c < 0x80) {
+            s.push_back(static_cast<char>(c));
+        } else if (c < 0x800) {
+            s.push_back(static_cast<char>(0xc0 | (c >> 6)));
+            s.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        } else if (c < 0x10000) {
+            s.push_back(static_cast<char>(0xe0 | (c >> 12)));
+            s.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+            s.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        } else {
+            s.push_back(static_cast<char>(0xf0 | (c >> 18)));
+            s.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3f)));
+            s.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+            s.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        }
+    }
+
+    bool escape(std::string & s)
+    {
+        if (p_ == end_)
+            return false;
+        switch (*p_++) {
+        case '"': s.push_back('"'); return true;
+        case '\\': s.push_back('\\'); return true;
+        case '/': s.push_back('/'); return true;
+        case 'b': s.push_back('\b'); return true;
+        case 'f': s.push_back('\f'); return true;
+        case 'n': s.push_back('\n'); return true;
+        case 'r': s.push_back('\r'); return true;
+        case 't': s.push_back('\t'); return true;
+        case 'u': break;
+        default: return false;
+        }
+        uint32_t c;
+        if (!hex4(c))
+            return false;
+        if (c >= 0xd800 && c < 0xdc00 && end_ - p_ >= 6 && p_[0] == '\\' && p_[1] == 'u') {
+            Char const * save = p_;
+            p_ += 2;
+            uint32_t low;
+            if (hex4(low) && low >= 0xdc00 && low < 0xe000)
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+            else
+                p_ = save;
+        }
+        // lone surrogates
+        if (c >= 0xd800 && c < 0xe000)
+            c = 0xfffd;
+        appendUtf8(c, s);
+        return true;
+    }
+
+    bool parseString(std::string & s)
+    {
+        ++p_;
+        while (true) {
+            size_t n = plainRun(p_, static_cast<size_t>(end_ - p_));
+            appendPlain(p_, n, s);
+            p_ += n;
+            if (p_ == end_ || *p_ < 0x20)
+                return false;
+            if (*p_++ == '"')
+                return true;
+            if (!escape(s))
+                return false;
+        }
+    }
+
+    static bool isDigit(Char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    bool parseNumber(Value & value)
+    {
+        Char const * start = p_;
+        bool negative = p_ < end_ && *p_ == '-';
+        if (negative)
+            ++p_;
+        if (p_ == end_ || !isDigit(*p_))
+            return false;
+        unsigned long long u = 0;
+        bool overflow = false;
+        if (*p_ == '0') {
+            ++p_;
+        } else {
+            for (; p_ < end_ && isDigit(*p_); ++p_) {
+                unsigned d = static_cast<unsigned>(*p_ - '0');
+                if (u > (std::numeric_limits<unsigned long long>::max() - d) / 10)
+                    overflow = true;
+                u = u * 10 + d;
+            }
+        }
+        bool integer = true;
+        if (p_ < end_ && *p_ == '.') {
+            integer = false;
+            ++p_;
+            if (p_ == end_ || !isDigit(*p_))
+                return false;
+            while (p_ < end_ && isDigit(*p_))
+                ++p_;
+        }
+        if (p_ < end_ && (*p_ == 'e' || *p_ == 'E')) {
+            integer = false;
+            ++p_;
+            if (p_ < end_ && (*p_ == '+' || *p_ == '-'))
+                ++p_;
+            if (p_ == end_ || !isDigit(*p_))
+                return false;
+            while (p_ < end_ && isDigit(*p_))
+                ++p_;
+        }
+        unsigned long long const limit = static_cast<unsigned long long>(
+                    std::numeric_limits<long long>::max()) + (negative ? 1 : 0);
+        if (integer && !overflow && u <= limit) {
+            long long n = negative ? static_cast<long long>(0ULL - u) : static_cast<long long>(u);
+            if (n >= std::numeric_limits<int>::min() && n <= std::numeric_limits<int>::max())
+                value = Value(static_cast<int>(n));
+            else
+                value = Value(n);
+            return true;
+        }
+        // strtod needs a terminated copy, the token is all ASCII
+        char token[64];
+        std::string longToken;
+        char * t = token;
+        size_t n = static_cast<size_t>(p_ - start);
+        if (n >= sizeof(token)) {
+            longToken.resize(n + 1);
+            t = &longToken[0];
+        }
+        for (size_t i = 0; i < n; ++i)
+            t[i] = static_cast<char>(start[i]);
+        t[n] = '\0';
+        value = Value(std::strtod(t, nullptr));
+        return true;
+    }
+
+private:
+    Char const * p_;
+    Char const * end_;
+};
+
+} // namespace
+
+bool readJson(const char *data, size_t size, Value &value)
+{
+    Value v;
+    if (!JsonReader<char>(data, size).document(v))
+        return false;
+    value = std::move(v);
+    return true;
+}
+
+bool readJson(const jchar *data, size_t size, Value &value)
+{
+    Value v;
+    if (!JsonReader<jchar>(data, size).document(v))
+        return false;
+    value = std::move(v);
+    return true;
+}
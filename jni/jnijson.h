@@ -0,0 +1,33 @@
+#ifndef JNIJSON_H
+#define JNIJSON_H
+
+#include "jnioutput.h"
+
+#include <core/value.h>
+
+#include <jni.h>
+
+#include <cstddef>
+#include <string>
+
+// JSON of messages over raw UTF-8 bytes, so a transport can serialize into
+// and parse from its own buffers without going through std::string copies.
+// Objects and nulls are written as null, non finite numbers as null.
+
+// Appends value to out
+void writeJson(Value const & value, JniOutput & out);
+
+inline void writeJson(Value const & value, std::string & out)
+{
+    JniOutput o(out);
+    writeJson(value, o);
+}
+
+// Parses the document in [data, data + size), returns false and leaves
+// value untouched on syntax errors
+bool readJson(char const * data, size_t size, Value & value);
+
+// Same over UTF-16, e.g. the pinned chars of a java string
+bool readJson(jchar const * data, size_t size, Value & value);
+
+#endif // JNIJSON_H
@@ -1,14 +1,16 @@
 #include "jnimeta.h"
+#include "jnichannel.h"
 #include "jniclass.h"
+#include "jnimetasnapshot.h"
 #include "jnivariant.h"
 #include <core/message.h>
 
-#include <iostream>
+#include <unordered_map>
 
 template <typename Meta>
 size_t findMeta(std::vector<Meta> const & metas, const Meta & meta)
 {
-    if (&meta >= &metas[0] && &meta < &metas.back())
+    if (!metas.empty() && &meta >= &metas.front() && &meta <= &metas.back())
         return std::size_t(&meta - &metas.front());
     for (size_t i = 0; i < metas.size(); ++i)
         if (meta == metas.at(i))
@@ -16,43 +18,92 @@ size_t findMeta(std::vector<Meta> const & metas, const Meta & meta)
     return size_t(-1);
 }
 
+template <typename T>
+static T arrayElement(JNIEnv * env, jobjectArray array, jsize index)
+{
+    return static_cast<T>(env->GetObjectArrayElement(array, index));
+}
+
 JniMetaObject::JniMetaObject(JniMetaObject * super, jclass clazz)
     : super_(super)
     , clazz_(static_cast<jclass>(env()->NewGlobalRef(clazz)))
+    , resolved_(false)
+    , resolving_(false)
+{
+    className_ = classClass(env()).getName(clazz);
+}
+
+// Members are reflected on first use, not when the class is first seen
+void JniMetaObject::resolve() const
+{
+    if (resolved_.load(std::memory_order_acquire))
+        return;
+    static std::recursive_mutex mutex;
+    std::lock_guard<std::recursive_mutex> l(mutex);
+    // reentered while building the index
+    if (resolved_.load(std::memory_order_relaxed) || resolving_)
+        return;
+    JniMetaObject * self = const_cast<JniMetaObject*>(this);
+    self->resolving_ = true;
+    if (super_)
+        super_->resolve();
+    self->resolveMembers();
+    self->flatten();
+    self->resolving_ = false;
+    resolved_.store(true, std::memory_order_release);
+    JniMetaSnapshot::resolved(this);
+}
+
+void JniMetaObject::resolveMembers()
 {
 //    for (int i = 0; i < meta_.enumeratorCount(); ++i) {
 //        metaEnums_.append(JniMetaEnum(meta_.enumerator(i)));
 //    }
 
-    JNIEnv * env = super->env();
-    ClassClass & cc = classClass(env);
-    MethodClass & mc = methodClass(env);
-    FieldClass & fc = fieldClass(env);
-    ModifierClass mfc = modifierClass(env);
-    (void) fc;
-    // class name
-    className_ = cc.getName(clazz);
-    std::cout << "JniMetaObject: " << className_ << std::endl;
+    JNIEnv * env = this->env();
+    if (JniMetaSnapshot::restore(env, *this))
+        return;
+    // all members with their names, modifiers and types in one upcall
+    JLocalRef<jobjectArray> members(env, channelClass(env).declaredMembers(clazz_));
+    if (JThrowable::clear(env))
+        return;
+    JLocalRef<jobjectArray> fields(env, arrayElement<jobjectArray>(env, members, 0));
+    JLocalRef<jobjectArray> fieldNames(env, arrayElement<jobjectArray>(env, members, 1));
+    JLocalRef<jintArray> fieldModifiers(env, arrayElement<jintArray>(env, members, 2));
+    JLocalRef<jobjectArray> fieldTypes(env, arrayElement<jobjectArray>(env, members, 3));
+    JLocalRef<jobjectArray> methods(env, arrayElement<jobjectArray>(env, members, 4));
+    JLocalRef<jobjectArray> methodNames(env, arrayElement<jobjectArray>(env, members, 5));
+    JLocalRef<jobjectArray> returnTypes(env, arrayElement<jobjectArray>(env, members, 6));
+    JLocalRef<jobjectArray> parameterTypes(env, arrayElement<jobjectArray>(env, members, 7));
     // fields
     std::vector<JniMetaProperty> metaProps;
-    for (auto field : cc.getDeclaredFields(clazz)) {
-        JLocalObjectRef lr(env, field);
-        metaProps.emplace_back(JniMetaProperty(this, field));
+    std::unordered_map<std::string, size_t> propNames;
+    jsize n = env->GetArrayLength(fields);
+    std::vector<jint> modifiers(static_cast<size_t>(n));
+    if (n > 0)
+        env->GetIntArrayRegion(fieldModifiers, 0, n, modifiers.data());
+    for (jsize i = 0; i < n; ++i) {
+        JLocalObjectRef field(env, env->GetObjectArrayElement(fields, i));
+        JLocalObjectRef fieldName(env, env->GetObjectArrayElement(fieldNames, i));
+        JLocalClassRef type(env, arrayElement<jclass>(env, fieldTypes, i));
+        metaProps.emplace_back(JniMetaProperty(this, field, JString(env, fieldName), modifiers[i], type));
+        propNames.emplace(metaProps.back().name(), metaProps.size() - 1);
     }
-    // methods
-    for (auto method : cc.getDeclaredMethods(clazz)) {
-        JLocalObjectRef lr(env, method);
-        int mod = mc.getModifiers(method);
-        if (!mfc.isPublic(mod) || mfc.isStatic(mod) || mfc.isAbstract(mod))
-            continue;
-        JniMetaMethod m(this, env->NewGlobalRef(method));
+    // public methods, not static or abstract
+    n = env->GetArrayLength(methods);
+    for (jsize i = 0; i < n; ++i) {
+        JLocalObjectRef method(env, env->GetObjectArrayElement(methods, i));
+        JLocalObjectRef methodName(env, env->GetObjectArrayElement(methodNames, i));
+        JLocalClassRef returnType(env, arrayElement<jclass>(env, returnTypes, i));
+        JLocalRef<jobjectArray> params(env, arrayElement<jobjectArray>(env, parameterTypes, i));
+        JniMetaMethod m(this, method, JString(env, methodName), returnType, params);
         if (m.parameterCount() == 0 && strncmp(m.name(), "get", 3) == 0) {
             std::string name = m.name() + 3;
             if (!name.empty() && name[0] <= 'Z')
                 name[0] += 'z' - 'Z';
-            size_t ip = findMeta(metaProps, JniMetaProperty(name));
-            if (ip < metaProps.size()) {
-                metaProps[ip].setGetter(method);
+            auto ip = propNames.find(name);
+            if (ip != propNames.end()) {
+                metaProps[ip->second].setGetter(m);
                 continue;
             }
         }
@@ -60,21 +111,18 @@ JniMetaObject::JniMetaObject(JniMetaObject * super, jclass clazz)
             std::string name = m.name() + 3;
             if (!name.empty() && name[0] <= 'Z')
                 name[0] += 'z' - 'Z';
-            size_t ip = findMeta(metaProps, JniMetaProperty(name));
-            if (ip < metaProps.size()) {
-                metaProps[ip].setSetter(method);
+            auto ip = propNames.find(name);
+            if (ip != propNames.end()) {
+                metaProps[ip->second].setSetter(m);
                 continue;
             }
         }
-        std::cout << "JniMetaObject: method: " << m.name() << std::endl;
         metaMethods_.emplace_back(std::move(m));
     }
     // props
     for (auto & prop : metaProps) {
-        if (prop.isValid()) {
-            std::cout << "JniMetaObject: property: " << prop.name() << std::endl;
+        if (prop.isValid())
             metaProps_.emplace_back(std::move(prop));
-        }
     }
 }
 
@@ -91,35 +139,63 @@ const char *JniMetaObject::className() const
 
 size_t JniMetaObject::propertyCount() const
 {
-    return super_->propertyCount() + metaProps_.size();
+    resolve();
+    return props_.size();
 }
 
 const MetaProperty &JniMetaObject::property(size_t index) const
 {
-    size_t n = super_->propertyCount();
-    return index < n ? super_->property(index) : metaProps_.at(index - n);
+    resolve();
+    return *props_[index];
 }
 
 size_t JniMetaObject::methodCount() const
 {
-    return super_->methodCount() + metaMethods_.size();
+    resolve();
+    return methods_.size();
 }
 
 const MetaMethod &JniMetaObject::method(size_t index) const
 {
-    size_t n = super_->methodCount();
-    return index < n ? super_->method(index) : metaMethods_.at(index - n);
+    resolve();
+    return *methods_[index];
 }
 
 size_t JniMetaObject::enumeratorCount() const
 {
-    return super_->enumeratorCount() + metaEnums_.size();
+    resolve();
+    return enums_.size();
 }
 
 const MetaEnum &JniMetaObject::enumerator(size_t index) const
 {
-    size_t n = super_->enumeratorCount();
-    return index < n ? super_->enumerator(index) : metaEnums_.at(index - n);
+    resolve();
+    return *enums_[index];
+}
+
+template <typename Meta, typename Base>
+static void flattenMetas(std::vector<Base const *> & table, std::vector<Base const *> const * inherited,
+                         std::vector<Meta> const & declared)
+{
+    table.clear();
+    table.reserve((inherited ? inherited->size() : 0) + declared.size());
+    if (inherited)
+        table.insert(table.end(), inherited->begin(), inherited->end());
+    for (auto & m : declared)
+        table.push_back(&m);
+}
+
+void JniMetaObject::flatten()
+{
+    flattenMetas(props_, super_ ? &super_->props_ : nullptr, metaProps_);
+    flattenMetas(methods_, super_ ? &super_->methods_ : nullptr, metaMethods_);
+    flattenMetas(enums_, super_ ? &super_->enums_ : nullptr, metaEnums_);
+    // declared members follow the inherited ones
+    for (size_t i = 0; i < metaProps_.size(); ++i)
+        metaProps_[i].slot_ = props_.size() - metaProps_.size() + i;
+    for (size_t i = 0; i < metaMethods_.size(); ++i)
+        metaMethods_[i].slot_ = methods_.size() - metaMethods_.size() + i;
+    index_.build(*this);
 }
 
 bool JniMetaObject::connect(const Connection &c) const
@@ -136,70 +212,199 @@ bool JniMetaObject::disconnect(const Connection &c) const
 
 size_t JniMetaObject::metaIndexOf(void const *meta, MetaType type) const
 {
+    resolve();
+    // by slot, overrides and overloads share names and value types
     if (type == Property)
-        return findMeta(metaProps_, *reinterpret_cast<JniMetaProperty const*>(meta))
-                + super_->propertyCount();
+        return reinterpret_cast<JniMetaProperty const*>(meta)->slot_;
     else if (type == Method)
-        return findMeta(metaMethods_, *reinterpret_cast<JniMetaMethod const*>(meta))
-                + super_->methodCount();
+        return reinterpret_cast<JniMetaMethod const*>(meta)->slot_;
     else
         return findMeta(metaEnums_, *reinterpret_cast<JniMetaEnum const*>(meta))
-                + super_->enumeratorCount();
+                + enums_.size() - metaEnums_.size();
 }
 
-JniMetaObject::JniMetaObject(JNIEnv *env)
-    : env_(env)
+JniMetaObject::JniMetaObject(JNIEnv *)
+    : super_(nullptr)
     , clazz_(nullptr)
+    , resolved_(false)
+    , resolving_(false)
 {
 
 }
 
-JniMetaProperty::JniMetaProperty(JniMetaObject *obj, jobject field)
-    : obj_(obj)
-    , field_(env()->NewGlobalRef(field))
+JniMetaIndex::JniMetaIndex()
+    : meta_(nullptr)
+{
+}
+
+void JniMetaIndex::build(const MetaObject &meta)
+{
+    meta_ = &meta;
+    size_t n = meta.propertyCount();
+    props_.assign(capacity(n), Entry{0, uint32_t(-1)});
+    for (size_t i = 0; i < n; ++i)
+        insert(props_, hash(meta.property(i).name()), i);
+    n = meta.methodCount();
+    methods_.assign(capacity(n), Entry{0, uint32_t(-1)});
+    for (size_t i = 0; i < n; ++i) {
+        MetaMethod const & m = meta.method(i);
+        uint32_t h = hash(m.name());
+        for (size_t j = 0; j < m.parameterCount(); ++j)
+            h = hash(h, m.parameterType(j));
+        insert(methods_, h, i);
+    }
+}
+
+size_t JniMetaIndex::propertyIndex(const char *name) const
+{
+    if (meta_ == nullptr)
+        return size_t(-1);
+    uint32_t h = hash(name);
+    size_t mask = props_.size() - 1;
+    for (size_t i = h & mask; props_[i].index != uint32_t(-1); i = (i + 1) & mask) {
+        if (props_[i].hash == h && strcmp(meta_->property(props_[i].index).name(), name) == 0)
+            return props_[i].index;
+    }
+    return size_t(-1);
+}
+
+size_t JniMetaIndex::methodIndex(const char *name, const std::vector<Value::Type> &paramTypes) const
+{
+    if (meta_ == nullptr)
+        return size_t(-1);
+    uint32_t h = hash(name);
+    for (Value::Type t : paramTypes)
+        h = hash(h, t);
+    size_t mask = methods_.size() - 1;
+    for (size_t i = h & mask; methods_[i].index != uint32_t(-1); i = (i + 1) & mask) {
+        if (methods_[i].hash != h)
+            continue;
+        MetaMethod const & m = meta_->method(methods_[i].index);
+        if (strcmp(m.name(), name) != 0 || m.parameterCount() != paramTypes.size())
+            continue;
+        size_t j = 0;
+        while (j < paramTypes.size() && m.parameterType(j) == paramTypes[j])
+            ++j;
+        if (j == paramTypes.size())
+            return methods_[i].index;
+    }
+    return size_t(-1);
+}
+
+size_t JniMetaIndex::methodIndex(const MetaMethod &method) const
+{
+    std::vector<Value::Type> paramTypes;
+    for (size_t i = 0; i < method.parameterCount(); ++i)
+        paramTypes.push_back(method.parameterType(i));
+    return methodIndex(method.name(), paramTypes);
+}
+
+uint32_t JniMetaIndex::hash(const char *name)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (; *name; ++name)
+        h = (h ^ static_cast<unsigned char>(*name)) * 16777619u;
+    return h;
+}
+
+uint32_t JniMetaIndex::hash(uint32_t h, Value::Type type)
+{
+    return (h ^ static_cast<uint32_t>(type + 1)) * 16777619u;
+}
+
+size_t JniMetaIndex::capacity(size_t count)
+{
+    // power of two, at most half full
+    size_t n = 1;
+    while (n < count * 2)
+        n <<= 1;
+    return n;
+}
+
+void JniMetaIndex::insert(std::vector<Entry> &table, uint32_t hash, size_t index)
 {
-    name_ = fieldClass().getName(field);
-    std::cout << "JniMetaProperty: " << name_ << std::endl;
+    size_t mask = table.size() - 1;
+    size_t i = hash & mask;
+    while (table[i].index != uint32_t(-1))
+        i = (i + 1) & mask;
+    table[i] = Entry{hash, static_cast<uint32_t>(index)};
+}
+
+JniMetaProperty::JniMetaProperty(JniMetaObject *obj, jobject field, std::string const & name,
+                                 jint modifiers, jclass type)
+    : obj_(obj)
+    , field_(nullptr)
+    , modifiers_(0)
+    , signature_('V')
+    , type_(Value::None)
+{
+    if (field) {
+        field_ = env()->FromReflectedField(field);
+        modifiers_ = modifiers;
+        signature_ = JniVariant::signature(type);
+        type_ = JniVariant::type(type);
+        name_ = name;
+        if (JniVariant::isReference(signature_))
+            typeClass_ = static_cast<jclass>(env()->NewGlobalRef(type));
+    }
 }
 
 JniMetaProperty::JniMetaProperty(JniMetaProperty &&o)
     : obj_(o.obj_)
     , field_(o.field_)
+    , modifiers_(o.modifiers_)
+    , signature_(o.signature_)
+    , type_(o.type_)
     , name_(std::move(o.name_))
     , getter_(o.getter_)
     , setter_(o.setter_)
+    , getterSignature_(o.getterSignature_)
+    , setterSignature_(o.setterSignature_)
+    , typeClass_(o.typeClass_)
+    , setterClass_(o.setterClass_)
+    , slot_(o.slot_)
 {
     o.obj_ = nullptr;
     o.field_ = nullptr;
     o.getter_ = nullptr;
     o.setter_ = nullptr;
+    o.typeClass_ = nullptr;
+    o.setterClass_ = nullptr;
 }
 
 JniMetaProperty::JniMetaProperty(const std::string &name)
     : obj_(nullptr)
     , field_(nullptr)
+    , modifiers_(0)
+    , signature_('V')
+    , type_(Value::None)
     , name_(name)
 {
 }
 
 JniMetaProperty::~JniMetaProperty()
 {
-    if (setter_)
-        env()->DeleteGlobalRef(setter_);
-    if (getter_)
-        env()->DeleteGlobalRef(getter_);
-    if (field_)
-        env()->DeleteGlobalRef(field_);
+    if (typeClass_)
+        jniEnv()->DeleteGlobalRef(typeClass_);
+    if (setterClass_)
+        jniEnv()->DeleteGlobalRef(setterClass_);
 }
 
-void JniMetaProperty::setSetter(jobject setter)
+void JniMetaProperty::setSetter(JniMetaMethod const & setter)
 {
-    setter_ = env()->NewGlobalRef(setter);
+    setter_ = setter.methodID();
+    setterSignature_ = setter.signature()[1];
+    if (setterClass_)
+        env()->DeleteGlobalRef(setterClass_);
+    setterClass_ = setter.parameterClass(0)
+            ? static_cast<jclass>(env()->NewGlobalRef(setter.parameterClass(0))) : nullptr;
 }
 
-void JniMetaProperty::setGetter(jobject getter)
+void JniMetaProperty::setGetter(JniMetaMethod const & getter)
 {
-    getter_ = env()->NewGlobalRef(getter);
+    getter_ = getter.methodID();
+    getterSignature_ = getter.signature()[0];
 }
 
 bool JniMetaProperty::operator==(const MetaProperty &o)
@@ -221,18 +426,18 @@ bool JniMetaProperty::isValid() const
 {
     if (obj_ == nullptr)
         return false;
-    int mod = fieldClass().getModifiers(field_);
-    return !modifierClass().isStatic(mod) && (getter_ || modifierClass().isPublic(mod));
+    return !modifierClass().isStatic(modifiers_) && (getter_ || modifierClass().isPublic(modifiers_));
 }
 
 Value::Type JniMetaProperty::type() const
 {
-    return Value::None;
+    return type_;
 }
 
+// Final fields are only written through a setter
 bool JniMetaProperty::isConstant() const
 {
-    return false;
+    return setter_ == nullptr && modifierClass().isFinal(modifiers_);
 }
 
 size_t JniMetaProperty::propertyIndex() const
@@ -260,41 +465,122 @@ Value JniMetaProperty::read(const Object *object) const
 {
     jobject jobj = static_cast<jobject>(const_cast<Object*>(object));
     if (getter_) {
-        return JniVariant::toValue(methodClass().invoke(getter_, jobj, nullptr));
+        Value value = JniMetaMethod::call(env(), jobj, getter_, getterSignature_, nullptr);
+        JThrowable::clear(env());
+        return value;
+    }
+    JNIEnv * env = this->env();
+    jvalue value;
+    switch (signature_) {
+    case 'Z':
+        value.z = env->GetBooleanField(jobj, field_);
+        break;
+    case 'B':
+        value.b = env->GetByteField(jobj, field_);
+        break;
+    case 'C':
+        value.c = env->GetCharField(jobj, field_);
+        break;
+    case 'S':
+        value.s = env->GetShortField(jobj, field_);
+        break;
+    case 'I':
+        value.i = env->GetIntField(jobj, field_);
+        break;
+    case 'J':
+        value.j = env->GetLongField(jobj, field_);
+        break;
+    case 'F':
+        value.f = env->GetFloatField(jobj, field_);
+        break;
+    case 'D':
+        value.d = env->GetDoubleField(jobj, field_);
+        break;
+    default:
+        value.l = env->GetObjectField(jobj, field_);
+        break;
     }
-    return JniVariant::toValue(fieldClass().get(field_, jobj));
+    Value result = JniVariant::toValue(value, signature_);
+    if (JniVariant::isReference(signature_) && value.l)
+        env->DeleteLocalRef(value.l);
+    return result;
 }
 
 bool JniMetaProperty::write(Object *object, Value &&value) const
 {
     jobject jobj = static_cast<jobject>(object);
     if (setter_) {
-        Array array;
-        array.emplace_back(std::move(value));
-        methodClass().invoke(setter_, jobj,
-                             static_cast<jobjectArray>(JniVariant::fromValue(std::move(array))));
-        return !JThrowable::clear(env());
+        jvalue arg = JniVariant::fromValue(value, setterSignature_);
+        bool typed = !JniVariant::isReference(setterSignature_) || !arg.l
+                || !setterClass_ || env()->IsInstanceOf(arg.l, setterClass_);
+        if (typed)
+            JniMetaMethod::call(env(), jobj, setter_, 'V', &arg);
+        if (JniVariant::isReference(setterSignature_) && arg.l)
+            env()->DeleteLocalRef(arg.l);
+        return typed && !JThrowable::clear(env());
+    }
+    if (isConstant())
+        return false;
+    JNIEnv * env = this->env();
+    jvalue v = JniVariant::fromValue(value, signature_);
+    if (JniVariant::isReference(signature_) && v.l && typeClass_ && !env->IsInstanceOf(v.l, typeClass_)) {
+        env->DeleteLocalRef(v.l);
+        return false;
     }
-    fieldClass().set(field_, static_cast<jobject>(object), JniVariant::fromValue(value));
-    return !JThrowable::clear(env());
+    switch (signature_) {
+    case 'Z':
+        env->SetBooleanField(jobj, field_, v.z);
+        break;
+    case 'B':
+        env->SetByteField(jobj, field_, v.b);
+        break;
+    case 'C':
+        env->SetCharField(jobj, field_, v.c);
+        break;
+    case 'S':
+        env->SetShortField(jobj, field_, v.s);
+        break;
+    case 'I':
+        env->SetIntField(jobj, field_, v.i);
+        break;
+    case 'J':
+        env->SetLongField(jobj, field_, v.j);
+        break;
+    case 'F':
+        env->SetFloatField(jobj, field_, v.f);
+        break;
+    case 'D':
+        env->SetDoubleField(jobj, field_, v.d);
+        break;
+    default:
+        env->SetObjectField(jobj, field_, v.l);
+        if (v.l)
+            env->DeleteLocalRef(v.l);
+        break;
+    }
+    return !JThrowable::clear(env);
 }
 
-JniMetaMethod::JniMetaMethod(JniMetaObject *obj, jobject method)
+JniMetaMethod::JniMetaMethod(JniMetaObject *obj, jobject method, std::string const & name,
+                             jclass returnType, jobjectArray paramTypes)
     : obj_(obj)
-    , method_(method)
+    , method_(nullptr)
+    , returnType_(Value::None)
 {
-    JNIEnv * env = obj->env();
     if (method) {
-        method_ = env->NewGlobalRef(method);
-        name_ = methodClass().getName(method);
-        returnType_ = JniVariant::type(methodClass().getReturnType(method));
-        jobjectArray types = methodClass().getParameterTypes(method);
-        int n = env->GetArrayLength(types);
+        JNIEnv * env = obj->env();
+        method_ = env->FromReflectedMethod(method);
+        name_ = name;
+        returnType_ = JniVariant::type(returnType);
+        signature_.push_back(JniVariant::signature(returnType));
+        int n = env->GetArrayLength(paramTypes);
         for (int i = 0; i < n; ++i) {
-            JLocalClassRef t(env, static_cast<jclass>(env->GetObjectArrayElement(types, i)));
+            JLocalClassRef t(env, static_cast<jclass>(env->GetObjectArrayElement(paramTypes, i)));
             paramTypes_.push_back(JniVariant::type(t));
+            signature_.push_back(JniVariant::signature(t));
+            paramClasses_.push_back(JniVariant::isReference(signature_.back())
+                                    ? static_cast<jclass>(env->NewGlobalRef(t)) : nullptr);
         }
-        std::cout << "JniMetaMethod: " << name_ << std::endl;
     } else {
         name_ = "destroyed";
     }
@@ -303,17 +589,24 @@ JniMetaMethod::JniMetaMethod(JniMetaObject *obj, jobject method)
 JniMetaMethod::JniMetaMethod(JniMetaMethod &&o)
     : obj_(o.obj_)
     , method_(o.method_)
+    , returnType_(o.returnType_)
     , name_(std::move(o.name_))
+    , signature_(std::move(o.signature_))
     , paramTypes_(std::move(o.paramTypes_))
+    , paramClasses_(std::move(o.paramClasses_))
+    , slot_(o.slot_)
 {
     o.obj_ = nullptr;
     o.method_ = nullptr;
+    o.paramClasses_.clear();
 }
 
 JniMetaMethod::~JniMetaMethod()
 {
-    if (method_)
-        obj_->env()->DeleteGlobalRef(method_);
+    for (jclass c : paramClasses_) {
+        if (c)
+            jniEnv()->DeleteGlobalRef(c);
+    }
 }
 
 static std::vector<Value::Type> parameterTypes(const MetaMethod &o)
@@ -392,12 +685,78 @@ const char *JniMetaMethod::parameterName(size_t index) const
     return names.at(index).c_str();
 }
 
+Value JniMetaMethod::call(JNIEnv *env, jobject object, jmethodID method, char returnSignature, const jvalue *args)
+{
+    jvalue result;
+    result.j = 0;
+    switch (returnSignature) {
+    case 'Z':
+        result.z = env->CallBooleanMethodA(object, method, args);
+        break;
+    case 'B':
+        result.b = env->CallByteMethodA(object, method, args);
+        break;
+    case 'C':
+        result.c = env->CallCharMethodA(object, method, args);
+        break;
+    case 'S':
+        result.s = env->CallShortMethodA(object, method, args);
+        break;
+    case 'I':
+        result.i = env->CallIntMethodA(object, method, args);
+        break;
+    case 'J':
+        result.j = env->CallLongMethodA(object, method, args);
+        break;
+    case 'F':
+        result.f = env->CallFloatMethodA(object, method, args);
+        break;
+    case 'D':
+        result.d = env->CallDoubleMethodA(object, method, args);
+        break;
+    case 'V':
+        env->CallVoidMethodA(object, method, args);
+        return Value();
+    default:
+        result.l = env->CallObjectMethodA(object, method, args);
+        break;
+    }
+    if (env->ExceptionCheck())
+        return Value();
+    Value value = JniVariant::toValue(result, returnSignature);
+    if (JniVariant::isReference(returnSignature) && result.l)
+        env->DeleteLocalRef(result.l);
+    return value;
+}
+
 bool JniMetaMethod::invoke(Object *object, Array &&args, const MetaMethod::Response &resp) const
 {
-    jobject returnValue = methodClass().invoke(method_, static_cast<jobject>(object),
-           static_cast<jobjectArray>(JniVariant::fromValue(std::move(args))));
-    resp(JniVariant::toValue(returnValue));
-    return JThrowable::clear(obj_->env());
+    if (method_ == nullptr || args.size() < paramTypes_.size())
+        return false;
+    JNIEnv * env = obj_->env();
+    size_t n = paramTypes_.size();
+    std::vector<jvalue> jargs(n);
+    auto release = [&] (size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            if (JniVariant::isReference(signature_[i + 1]) && jargs[i].l)
+                env->DeleteLocalRef(jargs[i].l);
+        }
+    };
+    for (size_t i = 0; i < n; ++i) {
+        jargs[i] = JniVariant::fromValue(args[i], signature_[i + 1]);
+        // the VM does not check argument types of Call*MethodA
+        jclass c = parameterClass(i);
+        if (c && jargs[i].l && !env->IsInstanceOf(jargs[i].l, c)) {
+            release(i + 1);
+            return false;
+        }
+    }
+    Value result = call(env, static_cast<jobject>(object), method_, signature_[0], jargs.data());
+    release(n);
+    if (JThrowable::clear(env))
+        return false;
+    resp(std::move(result));
+    return true;
 }
 
 JniMetaEnum::JniMetaEnum(JniMetaObject *obj, jclass enumClass)
@@ -443,20 +802,15 @@ int JniMetaEnum::value(size_t index) const
 JniObjectMetaObject::JniObjectMetaObject(JNIEnv *env)
     : JniMetaObject(env)
 {
-    metaMethods_.emplace_back(JniMetaMethod(this));
 }
 
-const char *JniObjectMetaObject::className() const
+void JniObjectMetaObject::resolveMembers()
 {
-    return "Object";
+    metaMethods_.emplace_back(JniMetaMethod(this));
 }
 
-size_t JniObjectMetaObject::methodCount() const
+const char *JniObjectMetaObject::className() const
 {
-    return metaMethods_.size();
+    return "Object";
 }
 
-const MetaMethod &JniObjectMetaObject::method(size_t index) const
-{
-    return metaMethods_.at(index);
-}
@@ -1,14 +1,57 @@
 #ifndef JNIMETA_H
 #define JNIMETA_H
 
+#include "jniclass.h"
+
 #include <core/metaobject.h>
 
 #include <jni.h>
 
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
 class JniMetaProperty;
 class JniMetaMethod;
 class JniMetaEnum;
 
+// Open addressing index from property name and from method name plus
+// parameter types to the (inherited) index in a MetaObject. Only for
+// lookups by name, members of a JniMetaObject know their own slot.
+class JniMetaIndex
+{
+public:
+    JniMetaIndex();
+
+    void build(MetaObject const & meta);
+
+    size_t propertyIndex(char const * name) const;
+
+    size_t methodIndex(char const * name, std::vector<Value::Type> const & paramTypes) const;
+
+    size_t methodIndex(MetaMethod const & method) const;
+
+private:
+    struct Entry
+    {
+        uint32_t hash;
+        uint32_t index;
+    };
+
+    static uint32_t hash(char const * name);
+
+    static uint32_t hash(uint32_t h, Value::Type type);
+
+    static size_t capacity(size_t count);
+
+    static void insert(std::vector<Entry> & table, uint32_t hash, size_t index);
+
+private:
+    MetaObject const * meta_;
+    std::vector<Entry> props_;
+    std::vector<Entry> methods_;
+};
+
 class JniMetaObject : public MetaObject
 {
 public:
@@ -32,7 +75,7 @@ public:
     using MetaObject::propertyChanged;
 
 public:
-    virtual JNIEnv *env() const { return super_->env(); }
+    JNIEnv *env() const { return jniEnv(); }
 
     enum MetaType
     {
@@ -43,19 +86,35 @@ public:
 
     size_t metaIndexOf(void const * meta, MetaType type) const;
 
+    size_t propertyIndex(char const * name) const { resolve(); return index_.propertyIndex(name); }
+
 protected:
     JniMetaObject(JNIEnv *env);
 
+    void resolve() const;
+
+    // Reflects the declared members, called once on first use
+    virtual void resolveMembers();
+
+    // Builds the flattened tables and the index, after the declared members
+    void flatten();
+
 protected:
-    union {
-        JNIEnv *env_;
-        JniMetaObject * super_;
-    };
+    friend class JniMetaSnapshot;
+
+    // Inherited followed by declared members, indexed access is one load
+    std::vector<MetaProperty const *> props_;
+    std::vector<MetaMethod const *> methods_;
+    std::vector<MetaEnum const *> enums_;
+    JniMetaObject * super_;
     jclass clazz_;
     std::string className_;
     std::vector<JniMetaProperty> metaProps_;
     std::vector<JniMetaMethod> metaMethods_;
     std::vector<JniMetaEnum> metaEnums_;
+    JniMetaIndex index_;
+    mutable std::atomic<bool> resolved_;
+    bool resolving_;
 };
 
 class JniObjectMetaObject : public JniMetaObject
@@ -66,18 +125,17 @@ public:
     // MetaObject interface
 public:
     virtual const char *className() const override;
-    virtual size_t propertyCount() const override { return 0; }
-    virtual size_t methodCount() const override;
-    virtual const MetaMethod &method(size_t index) const override;
-    virtual size_t enumeratorCount() const override { return 0; }
 
-    virtual JNIEnv *env() const override { return env_; }
+protected:
+    virtual void resolveMembers() override;
 };
 
 class JniMetaProperty : public MetaProperty
 {
 public:
-    JniMetaProperty(JniMetaObject *obj = nullptr, jobject field = nullptr);
+    // field with its name, modifiers and type as returned by Channel.declaredMembers
+    JniMetaProperty(JniMetaObject *obj = nullptr, jobject field = nullptr, std::string const & name = std::string(),
+                    jint modifiers = 0, jclass type = nullptr);
 
     JniMetaProperty(JniMetaProperty && o);
 
@@ -85,9 +143,9 @@ public:
 
     ~JniMetaProperty() override;
 
-    void setSetter(jobject setter);
+    void setSetter(JniMetaMethod const & setter);
 
-    void setGetter(jobject getter);
+    void setGetter(JniMetaMethod const & getter);
 
     friend bool operator==(JniMetaProperty const & l, JniMetaProperty const & r);
 
@@ -110,17 +168,32 @@ private:
     JNIEnv *env() const { return obj_->env(); }
 
 private:
+    friend class JniMetaObject;
+    friend class JniMetaSnapshot;
+
     JniMetaObject *obj_;
-    jobject field_;
+    jfieldID field_;
+    int modifiers_;
+    char signature_;
+    Value::Type type_;
     std::string name_;
-    jobject getter_ = nullptr;
-    jobject setter_ = nullptr;
+    jmethodID getter_ = nullptr;
+    jmethodID setter_ = nullptr;
+    char getterSignature_ = 'V';
+    char setterSignature_ = 'V';
+    // global refs of the field and setter parameter types, for references
+    jclass typeClass_ = nullptr;
+    jclass setterClass_ = nullptr;
+    // index in the flattened table of obj_
+    size_t slot_ = size_t(-1);
 };
 
 class JniMetaMethod : public MetaMethod
 {
 public:
-    JniMetaMethod(JniMetaObject *obj = nullptr, jobject method = nullptr);
+    // method with its name, return and parameter types as returned by Channel.declaredMembers
+    JniMetaMethod(JniMetaObject *obj = nullptr, jobject method = nullptr, std::string const & name = std::string(),
+                  jclass returnType = nullptr, jobjectArray paramTypes = nullptr);
 
     JniMetaMethod(JniMetaMethod && o);
 
@@ -130,6 +203,16 @@ public:
 
     bool operator==(MetaMethod const & o);
 
+    jmethodID methodID() const { return method_; }
+
+    // signature chars of return type followed by parameter types, see JniVariant::signature
+    std::string const & signature() const { return signature_; }
+
+    // declared class of a reference parameter, null for primitives
+    jclass parameterClass(size_t index) const { return index < paramClasses_.size() ? paramClasses_[index] : nullptr; }
+
+    static Value call(JNIEnv * env, jobject object, jmethodID method, char returnSignature, jvalue const * args);
+
     // MetaMethod interface
 public:
     virtual const char *name() const override;
@@ -145,11 +228,18 @@ public:
     virtual bool invoke(Object *object, Array &&args, Response const & resp) const override;
 
 private:
+    friend class JniMetaObject;
+    friend class JniMetaSnapshot;
+
     JniMetaObject *obj_;
-    jobject method_;
+    jmethodID method_;
     Value::Type returnType_;
     std::string name_;
+    std::string signature_;
     std::vector<Value::Type> paramTypes_;
+    // global refs of reference parameter types, null for primitives
+    std::vector<jclass> paramClasses_;
+    size_t slot_ = size_t(-1);
 };
 
 class JniMetaEnum : public MetaEnum
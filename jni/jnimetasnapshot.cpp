@@ -0,0 +1,413 @@
+#include "jnimetasnapshot.h"
+#include "jniclass.h"
+#include "jnimeta.h"
+#include "jnivariant.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <unordered_set>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+
+namespace {
+
+enum : uint32_t
+{
+    Magic = 0x534d4248, // "HBMS"
+    Version = 3,
+    ByteOrder = 0x01020304,
+    HeaderSize = 16,
+};
+
+struct Writer
+{
+    std::string & out;
+    template <typename T>
+    void put(T t) { out.append(reinterpret_cast<char const *>(&t), sizeof(t)); }
+    void str(std::string const & s) { put(static_cast<uint32_t>(s.size())); out.append(s); }
+};
+
+struct Reader
+{
+    char const * p;
+    char const * end;
+    bool ok;
+    template <typename T>
+    T get()
+    {
+        T t = T();
+        if (static_cast<size_t>(end - p) < sizeof(t)) {
+            ok = false;
+            return t;
+        }
+        memcpy(&t, p, sizeof(t));
+        p += sizeof(t);
+        return t;
+    }
+    std::string str()
+    {
+        uint32_t n = get<uint32_t>();
+        if (!ok || static_cast<size_t>(end - p) < n) {
+            ok = false;
+            return std::string();
+        }
+        p += n;
+        return std::string(p - n, n);
+    }
+};
+
+std::string methodDescriptor(JNIEnv * env, jclass clazz, jmethodID method,
+                             std::string (*descriptor)(JNIEnv *, jclass))
+{
+    JLocalObjectRef m(env, env->ToReflectedMethod(clazz, method, JNI_FALSE));
+    MethodClass & mc = methodClass(env);
+    std::string desc = "(";
+    JLocalRef<jobjectArray> types(env, mc.getParameterTypes(m));
+    jsize n = env->GetArrayLength(types);
+    for (jsize i = 0; i < n; ++i) {
+        JLocalClassRef t(env, static_cast<jclass>(env->GetObjectArrayElement(types, i)));
+        desc += descriptor(env, t);
+    }
+    JLocalClassRef rt(env, mc.getReturnType(m));
+    desc += ")" + descriptor(env, rt);
+    return desc;
+}
+
+std::string methodName(JNIEnv * env, jclass clazz, jmethodID method)
+{
+    JLocalObjectRef m(env, env->ToReflectedMethod(clazz, method, JNI_FALSE));
+    return methodClass(env).getName(m);
+}
+
+// Field descriptors of the parameters in a method descriptor
+std::vector<std::string> parameterDescriptors(std::string const & desc)
+{
+    std::vector<std::string> params;
+    size_t i = 1;
+    while (i < desc.size() && desc[i] != ')') {
+        size_t start = i;
+        while (i < desc.size() && desc[i] == '[')
+            ++i;
+        if (i < desc.size() && desc[i] == 'L')
+            i = desc.find(';', i);
+        if (i >= desc.size())
+            break;
+        ++i;
+        params.push_back(desc.substr(start, i - start));
+    }
+    return params;
+}
+
+}
+
+JniMetaSnapshot::JniMetaSnapshot()
+    : data_(nullptr)
+    , size_(0)
+    , mapped_(false)
+{
+}
+
+JniMetaSnapshot::~JniMetaSnapshot()
+{
+    close();
+}
+
+JniMetaSnapshot &JniMetaSnapshot::instance()
+{
+    static JniMetaSnapshot snapshot;
+    return snapshot;
+}
+
+void JniMetaSnapshot::close()
+{
+#ifndef _WIN32
+    if (mapped_)
+        munmap(const_cast<char *>(data_), size_);
+#endif
+    records_.clear();
+    buffer_.clear();
+    data_ = nullptr;
+    size_ = 0;
+    mapped_ = false;
+}
+
+bool JniMetaSnapshot::open(JNIEnv *, const std::string &path, const std::string &version)
+{
+    JniMetaSnapshot & s = instance();
+    std::lock_guard<std::mutex> l(s.mutex_);
+    s.close();
+    s.path_ = path;
+    s.version_ = version;
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void * data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            s.data_ = static_cast<char const *>(data);
+            s.size_ = static_cast<size_t>(st.st_size);
+            s.mapped_ = true;
+        }
+    }
+    ::close(fd);
+#else
+    std::ifstream file(path, std::ios::binary);
+    s.buffer_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    s.data_ = s.buffer_.data();
+    s.size_ = s.buffer_.size();
+#endif
+    Reader r{s.data_, s.data_ + s.size_, true};
+    if (r.get<uint32_t>() != Magic || r.get<uint32_t>() != Version
+            || r.get<uint32_t>() != ByteOrder) {
+        s.close();
+        return false;
+    }
+    uint32_t n = r.get<uint32_t>();
+    // saved by another build of the app
+    if (r.str() != version || !r.ok) {
+        s.close();
+        return false;
+    }
+    for (uint32_t i = 0; i < n && r.ok; ++i) {
+        uint32_t size = r.get<uint32_t>();
+        if (!r.ok || static_cast<size_t>(r.end - r.p) < size)
+            break;
+        Reader rr{r.p, r.p + size, true};
+        std::string name = rr.str();
+        if (rr.ok)
+            s.records_.emplace(name, std::make_pair(r.p, size_t(size)));
+        r.p += size;
+    }
+    return true;
+}
+
+bool JniMetaSnapshot::save(JNIEnv *env)
+{
+    JniMetaSnapshot & s = instance();
+    std::lock_guard<std::mutex> l(s.mutex_);
+    if (s.path_.empty())
+        return false;
+    std::string out;
+    Writer w{out};
+    w.put<uint32_t>(Magic);
+    w.put<uint32_t>(Version);
+    w.put<uint32_t>(ByteOrder);
+    w.put<uint32_t>(0);
+    w.str(s.version_);
+    uint32_t count = 0;
+    std::unordered_set<std::string> names;
+    std::string record;
+    for (JniMetaObject const * meta : s.metas_) {
+        record.clear();
+        if (!names.insert(meta->className()).second || !write(env, *meta, record))
+            continue;
+        w.put(static_cast<uint32_t>(record.size()));
+        out.append(record);
+        ++count;
+    }
+    // classes not loaded in this process
+    for (auto & r : s.records_) {
+        if (names.count(r.first))
+            continue;
+        w.put(static_cast<uint32_t>(r.second.second));
+        out.append(r.second.first, r.second.second);
+        ++count;
+    }
+    memcpy(&out[HeaderSize - sizeof(count)], &count, sizeof(count));
+    std::string tmp = s.path_ + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        file.write(out.data(), static_cast<std::streamsize>(out.size()));
+        if (!file)
+            return false;
+    }
+    // replaces the old snapshot atomically, a mapping of it stays valid
+#ifndef _WIN32
+    return std::rename(tmp.c_str(), s.path_.c_str()) == 0;
+#else
+    return MoveFileExA(tmp.c_str(), s.path_.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#endif
+}
+
+bool JniMetaSnapshot::restore(JNIEnv *env, JniMetaObject &meta)
+{
+    JniMetaSnapshot & s = instance();
+    std::lock_guard<std::mutex> l(s.mutex_);
+    auto it = s.records_.find(meta.className_);
+    if (it == s.records_.end())
+        return false;
+    return read(env, it->second.first, it->second.second, meta);
+}
+
+void JniMetaSnapshot::resolved(const JniMetaObject *meta)
+{
+    if (meta->clazz_ == nullptr)
+        return;
+    JniMetaSnapshot & s = instance();
+    std::lock_guard<std::mutex> l(s.mutex_);
+    s.metas_.push_back(meta);
+}
+
+// Stored modifiers are trusted, the snapshot is tied to the app version.
+// A member type costs a class lookup the first time it is seen.
+jclass JniMetaSnapshot::loadClass(JNIEnv *env, jobject loader, const std::string &desc)
+{
+    ClassClass & cc = classClass(env);
+    JniMetaSnapshot & s = instance();
+    std::vector<std::pair<jobject, jclass>> & loaded = s.classes_[desc];
+    for (auto & l : loaded) {
+        if (env->IsSameObject(l.first, loader))
+            return static_cast<jclass>(env->NewGlobalRef(l.second));
+    }
+    std::string name = desc[0] == 'L' ? desc.substr(1, desc.size() - 2) : desc;
+    for (auto & c : name)
+        if (c == '/')
+            c = '.';
+    JLocalClassRef c(env, cc.forName(name, loader));
+    if (JThrowable::clear(env) || static_cast<jclass>(c) == nullptr)
+        return nullptr;
+    // kept for the process, like the metas
+    loaded.emplace_back(env->NewGlobalRef(loader), static_cast<jclass>(env->NewGlobalRef(c)));
+    return static_cast<jclass>(env->NewGlobalRef(c));
+}
+
+std::string JniMetaSnapshot::descriptor(JNIEnv *env, jclass clazz)
+{
+    ClassClass & cc = classClass(env);
+    std::string name = cc.getName(clazz);
+    if (cc.isPrimitive(clazz)) {
+        static char const * const primitives[][2] = {
+            {"boolean", "Z"}, {"byte", "B"}, {"char", "C"}, {"short", "S"},
+            {"int", "I"}, {"long", "J"}, {"float", "F"}, {"double", "D"},
+            {"void", "V"},
+        };
+        for (auto & p : primitives)
+            if (name == p[0])
+                return p[1];
+        return std::string();
+    }
+    for (auto & c : name)
+        if (c == '.')
+            c = '/';
+    return name[0] == '[' ? name : "L" + name + ";";
+}
+
+bool JniMetaSnapshot::write(JNIEnv *env, const JniMetaObject &meta, std::string &out)
+{
+    jclass clazz = meta.clazz_;
+    Writer w{out};
+    w.str(meta.className_);
+    w.put(static_cast<uint32_t>(meta.metaProps_.size()));
+    for (JniMetaProperty const & p : meta.metaProps_) {
+        JLocalObjectRef f(env, env->ToReflectedField(clazz, p.field_, JNI_FALSE));
+        JLocalClassRef t(env, fieldClass(env).getType(f));
+        w.str(p.name_);
+        w.str(descriptor(env, t));
+        w.put<int32_t>(p.modifiers_);
+        w.put(p.signature_);
+        w.put<uint8_t>(static_cast<uint8_t>(p.type_));
+        w.str(p.getter_ ? methodName(env, clazz, p.getter_) : std::string());
+        w.str(p.getter_ ? methodDescriptor(env, clazz, p.getter_, descriptor) : std::string());
+        w.put(p.getterSignature_);
+        w.str(p.setter_ ? methodName(env, clazz, p.setter_) : std::string());
+        w.str(p.setter_ ? methodDescriptor(env, clazz, p.setter_, descriptor) : std::string());
+        w.put(p.setterSignature_);
+    }
+    w.put(static_cast<uint32_t>(meta.metaMethods_.size()));
+    for (JniMetaMethod const & m : meta.metaMethods_) {
+        w.str(m.name_);
+        w.str(methodDescriptor(env, clazz, m.method_, descriptor));
+        w.str(m.signature_);
+        w.put<uint8_t>(static_cast<uint8_t>(m.returnType_));
+        w.put(static_cast<uint32_t>(m.paramTypes_.size()));
+        for (Value::Type t : m.paramTypes_)
+            w.put<uint8_t>(static_cast<uint8_t>(t));
+    }
+    return !JThrowable::clear(env);
+}
+
+bool JniMetaSnapshot::read(JNIEnv *env, const char *data, size_t size, JniMetaObject &meta)
+{
+    jclass clazz = meta.clazz_;
+    // member types are loaded through the loader of clazz
+    JLocalObjectRef loader(env, classClass(env).getClassLoader(clazz));
+    Reader r{data, data + size, true};
+    if (r.str() != meta.className_)
+        return false;
+    std::vector<JniMetaProperty> props;
+    uint32_t n = r.get<uint32_t>();
+    for (uint32_t i = 0; i < n && r.ok; ++i) {
+        JniMetaProperty p(&meta);
+        p.name_ = r.str();
+        std::string desc = r.str();
+        p.modifiers_ = r.get<int32_t>();
+        p.signature_ = r.get<char>();
+        p.type_ = static_cast<Value::Type>(r.get<uint8_t>());
+        std::string getter = r.str();
+        std::string getterDesc = r.str();
+        p.getterSignature_ = r.get<char>();
+        std::string setter = r.str();
+        std::string setterDesc = r.str();
+        p.setterSignature_ = r.get<char>();
+        if (!r.ok)
+            return false;
+        p.field_ = env->GetFieldID(clazz, p.name_.c_str(), desc.c_str());
+        if (!getter.empty())
+            p.getter_ = env->GetMethodID(clazz, getter.c_str(), getterDesc.c_str());
+        if (!setter.empty())
+            p.setter_ = env->GetMethodID(clazz, setter.c_str(), setterDesc.c_str());
+        if (JThrowable::clear(env))
+            return false;
+        if (JniVariant::isReference(p.signature_)
+                && (p.typeClass_ = loadClass(env, loader, desc)) == nullptr)
+            return false;
+        if (p.setter_ && JniVariant::isReference(p.setterSignature_)) {
+            std::vector<std::string> params = parameterDescriptors(setterDesc);
+            if (params.size() != 1 || (p.setterClass_ = loadClass(env, loader, params[0])) == nullptr)
+                return false;
+        }
+        props.emplace_back(std::move(p));
+    }
+    std::vector<JniMetaMethod> methods;
+    n = r.get<uint32_t>();
+    for (uint32_t i = 0; i < n && r.ok; ++i) {
+        JniMetaMethod m(&meta);
+        m.name_ = r.str();
+        std::string desc = r.str();
+        m.signature_ = r.str();
+        m.returnType_ = static_cast<Value::Type>(r.get<uint8_t>());
+        uint32_t np = r.get<uint32_t>();
+        for (uint32_t j = 0; j < np && r.ok; ++j)
+            m.paramTypes_.push_back(static_cast<Value::Type>(r.get<uint8_t>()));
+        if (!r.ok)
+            return false;
+        m.method_ = env->GetMethodID(clazz, m.name_.c_str(), desc.c_str());
+        std::vector<std::string> params = parameterDescriptors(desc);
+        if (JThrowable::clear(env) || m.signature_.size() != np + 1 || params.size() != np)
+            return false;
+        for (uint32_t j = 0; j < np; ++j) {
+            jclass c = nullptr;
+            if (JniVariant::isReference(m.signature_[j + 1])
+                    && (c = loadClass(env, loader, params[j])) == nullptr)
+                return false;
+            m.paramClasses_.push_back(c);
+        }
+        methods.emplace_back(std::move(m));
+    }
+    if (!r.ok || r.p != r.end)
+        return false;
+    meta.metaProps_ = std::move(props);
+    meta.metaMethods_ = std::move(methods);
+    return true;
+}
@@ -0,0 +1,75 @@
+#ifndef JNIMETASNAPSHOT_H
+#define JNIMETASNAPSHOT_H
+
+#include <jni.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class JniMetaObject;
+
+/*
+ * Versioned binary snapshot of resolved JniMetaObjects.
+ *
+ * The file is tagged with a version supplied by the app, e.g. its build
+ * number, and discarded when that changes. A record holds the class name
+ * and per member the name, the JVM descriptor, the modifiers and the
+ * converted types. A process that maps the snapshot resolves ids with
+ * GetFieldID/GetMethodID instead of walking the declared members, and
+ * loads member types by descriptor, once per type and class loader. A
+ * record is only used when every id and type resolves, otherwise the class
+ * is reflected as usual.
+ */
+class JniMetaSnapshot
+{
+public:
+    // Maps the snapshot at path if it exists and was saved with the same
+    // version, remembers both for save()
+    static bool open(JNIEnv * env, std::string const & path, std::string const & version);
+
+    // Writes all metas resolved in this process plus records not used yet
+    static bool save(JNIEnv * env);
+
+    // Fills the declared members of meta from its record
+    static bool restore(JNIEnv * env, JniMetaObject & meta);
+
+    // Called for every resolved meta, restored or reflected
+    static void resolved(JniMetaObject const * meta);
+
+private:
+    JniMetaSnapshot();
+
+    ~JniMetaSnapshot();
+
+    static JniMetaSnapshot & instance();
+
+    void close();
+
+    // Global ref of the class of a field descriptor as seen by loader
+    static jclass loadClass(JNIEnv * env, jobject loader, std::string const & desc);
+
+    static std::string descriptor(JNIEnv * env, jclass clazz);
+
+    static bool write(JNIEnv * env, JniMetaObject const & meta, std::string & out);
+
+    static bool read(JNIEnv * env, char const * data, size_t size, JniMetaObject & meta);
+
+private:
+    std::mutex mutex_;
+    std::string path_;
+    std::string version_;
+    char const * data_;
+    size_t size_;
+    bool mapped_;
+    std::string buffer_;
+    // class name -> record in data_
+    std::unordered_map<std::string, std::pair<char const *, size_t>> records_;
+    std::vector<JniMetaObject const *> metas_;
+    // field descriptor -> class loaded by each loader, both global refs
+    std::unordered_map<std::string, std::vector<std::pair<jobject, jclass>>> classes_;
+};
+
+#endif // JNIMETASNAPSHOT_H
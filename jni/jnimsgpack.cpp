@@ -0,0 +1,308 @@
+#include "jnimsgpack.h"
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// Nesting deeper than this is rejected instead of overflowing the stack
+enum { MaxDepth = 256 };
+
+static void writeBig(uint64_t v, int bytes, JniOutput & out)
+{
+    char buf[8];
+    for (int i = bytes - 1; i >= 0; --i) {
+        buf[i] = static_cast<char>(v & 0xff);
+        v >>= 8;
+    }
+    out.append(buf, static_cast<size_t>(bytes));
+}
+
+static void writeTagged(unsigned char tag, uint64_t v, int bytes, JniOutput & out)
+{
+    out.push_back(static_cast<char>(tag));
+    writeBig(v, bytes, out);
+}
+
+static void writeInteger(long long n, JniOutput & out)
+{
+    if (n >= 0) {
+        uint64_t u = static_cast<uint64_t>(n);
+        if (u < 0x80)
+            out.push_back(static_cast<char>(u));
+        else if (u <= 0xff)
+            writeTagged(0xcc, u, 1, out);
+        else if (u <= 0xffff)
+            writeTagged(0xcd, u, 2, out);
+        else if (u <= 0xffffffff)
+            writeTagged(0xce, u, 4, out);
+        else
+            writeTagged(0xcf, u, 8, out);
+    } else {
+        uint64_t u = static_cast<uint64_t>(n);
+        if (n >= -32)
+            out.push_back(static_cast<char>(n));
+        else if (n >= -0x80)
+            writeTagged(0xd0, u, 1, out);
+        else if (n >= -0x8000)
+            writeTagged(0xd1, u, 2, out);
+        else if (n >= -0x80000000LL)
+            writeTagged(0xd2, u, 4, out);
+        else
+            writeTagged(0xd3, u, 8, out);
+    }
+}
+
+// Header of a str, array or map, fix is the tag of the short form
+static void writeHeader(unsigned char fix, size_t fixMax, unsigned char tag16, size_t n, JniOutput & out)
+{
+    if (n < fixMax)
+        out.push_back(static_cast<char>(fix | n));
+    else if (n <= 0xffff)
+        writeTagged(tag16, n, 2, out);
+    else
+        writeTagged(static_cast<unsigned char>(tag16 + 1), n, 4, out);
+}
+
+static void writeString(std::string const & s, JniOutput & out)
+{
+    if (s.size() >= 32 && s.size() <= 0xff)
+        writeTagged(0xd9, s.size(), 1, out);
+    else
+        writeHeader(0xa0, 32, 0xda, s.size(), out);
+    out.append(s.data(), s.size());
+}
+
+void writeMsgPack(const Value &value, JniOutput &out)
+{
+    switch (value.type()) {
+    case Value::Bool:
+        out.push_back(static_cast<char>(value.toBool() ? 0xc3 : 0xc2));
+        break;
+    case Value::Int:
+        writeInteger(value.toInt(), out);
+        break;
+    case Value::Long:
+        writeInteger(value.toLong(), out);
+        break;
+    case Value::Float: {
+        float f = value.toFloat();
+        uint32_t u;
+        std::memcpy(&u, &f, sizeof(u));
+        writeTagged(0xca, u, 4, out);
+        break;
+    }
+    case Value::Double: {
+        double d = value.toDouble();
+        uint64_t u;
+        std::memcpy(&u, &d, sizeof(u));
+        writeTagged(0xcb, u, 8, out);
+        break;
+    }
+    case Value::String:
+        writeString(value.toString(), out);
+        break;
+    case Value::Array_: {
+        Array const & array = value.toArray();
+        writeHeader(0x90, 16, 0xdc, array.size(), out);
+        for (Value const & v : array)
+            writeMsgPack(v, out);
+        break;
+    }
+    case Value::Map_: {
+        Map const & map = value.toMap();
+        writeHeader(0x80, 16, 0xde, map.size(), out);
+        for (auto const & e : map) {
+            writeString(e.first, out);
+            writeMsgPack(e.second, out);
+        }
+        break;
+    }
+    default:
+        out.push_back(static_cast<char>(0xc0));
+        break;
+    }
+}
+
+namespace {
+
+class MsgPackReader
+{
+public:
+    MsgPackReader(char const * data, size_t size)
+        : p_(reinterpret_cast<unsigned char const *>(data))
+        , end_(p_ + size)
+    {
+    }
+
+    bool document(Value & value)
+    {
+        return parse(value, 0) && p_ == end_;
+    }
+
+private:
+    bool big(int bytes, uint64_t & v)
+    {
+        if (end_ - p_ < bytes)
+            return false;
+        v = 0;
+        for (int i = 0; i < bytes; ++i)
+            v = (v << 8) | *p_++;
+        return true;
+    }
+
+    static Value integer(long long n)
+    {
+        if (n >= std::numeric_limits<int>::min() && n <= std::numeric_limits<int>::max())
+            return Value(static_cast<int>(n));
+        return Value(n);
+    }
+
+    bool parseString(size_t n, std::string & s)
+    {
+        if (static_cast<size_t>(end_ - p_) < n)
+            return false;
+        s.assign(reinterpret_cast<char const *>(p_), n);
+        p_ += n;
+        return true;
+    }
+
+    bool parseKey(std::string & key)
+    {
+        if (p_ == end_)
+            return false;
+        unsigned char c = *p_++;
+        uint64_t n;
+        if ((c & 0xe0) == 0xa0)
+            n = c & 0x1f;
+        else if (c < 0xd9 || c > 0xdb || !big(1 << (c - 0xd9), n))
+            return false;
+        return parseString(static_cast<size_t>(n), key);
+    }
+
+    bool parseArray(size_t n, Value & value, int depth)
+    {
+        // every element takes at least a byte
+        if (static_cast<size_t>(end_ - p_) < n)
+            return false;
+        Array array(n);
+        for (Value & v : array) {
+            if (!parse(v, depth + 1))
+                return false;
+        }
+        value = Value(std::move(array));
+        return true;
+    }
+
+    bool parseMap(size_t n, Value & value, int depth)
+    {
+        if (static_cast<size_t>(end_ - p_) < n * 2)
+            return false;
+        Map map;
+        for (size_t i = 0; i < n; ++i) {
+            std::string key;
+            if (!parseKey(key) || !parse(map[std::move(key)], depth + 1))
+                return false;
+        }
+        value = Value(std::move(map));
+        return true;
+    }
+
+    bool parse(Value & value, int depth)
+    {
+        if (p_ == end_ || depth > MaxDepth)
+            return false;
+        unsigned char c = *p_++;
+        if (c < 0x80) {
+            value = Value(static_cast<int>(c));
+            return true;
+        }
+        if (c >= 0xe0) {
+            value = Value(static_cast<int>(static_cast<signed char>(c)));
+            return true;
+        }
+        if ((c & 0xf0) == 0x80)
+            return parseMap(c & 0x0f, value, depth);
+        if ((c & 0xf0) == 0x90)
+            return parseArray(c & 0x0f, value, depth);
+        if ((c & 0xe0) == 0xa0) {
+            std::string s;
+            if (!parseString(c & 0x1f, s))
+                return false;
+            value = Value(std::move(s));
+            return true;
+        }
+        uint64_t u;
+        switch (c) {
+        case 0xc0:
+            value = Value();
+            return true;
+        case 0xc2:
+        case 0xc3:
+            value = Value(c == 0xc3);
+            return true;
+        case 0xca: {
+            if (!big(4, u))
+                return false;
+            uint32_t u32 = static_cast<uint32_t>(u);
+            float f;
+            std::memcpy(&f, &u32, sizeof(f));
+            value = Value(f);
+            return true;
+        }
+        case 0xcb: {
+            if (!big(8, u))
+                return false;
+            double d;
+            std::memcpy(&d, &u, sizeof(d));
+            value = Value(d);
+            return true;
+        }
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+            if (!big(1 << (c - 0xcc), u))
+                return false;
+            if (u > static_cast<uint64_t>(std::numeric_limits<long long>::max()))
+                value = Value(static_cast<double>(u));
+            else
+                value = integer(static_cast<long long>(u));
+            return true;
+        case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+            int bytes = 1 << (c - 0xd0);
+            if (!big(bytes, u))
+                return false;
+            // sign extend
+            int shift = 64 - bytes * 8;
+            value = integer(static_cast<long long>(u << shift) >> shift);
+            return true;
+        }
+        case 0xd9: case 0xda: case 0xdb: {
+            std::string s;
+            if (!big(1 << (c - 0xd9), u) || !parseString(static_cast<size_t>(u), s))
+                return false;
+            value = Value(std::move(s));
+            return true;
+        }
+        case 0xdc: case 0xdd:
+            return big(2 << (c - 0xdc), u) && parseArray(static_cast<size_t>(u), value, depth);
+        case 0xde: case 0xdf:
+            return big(2 << (c - 0xde), u) && parseMap(static_cast<size_t>(u), value, depth);
+        default:
+            // bin, ext and reserved types are not produced by writeMsgPack
+            return false;
+        }
+    }
+
+private:
+    unsigned char const * p_;
+    unsigned char const * end_;
+};
+
+} // namespace
+
+bool readMsgPack(const char *data, size_t size, Value &value)
+{
+    Value v;
+    if (!MsgPackReader(data, size).document(v))
+        return false;
+    value = std::move(v);
+    return true;
+}
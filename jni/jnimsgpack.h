@@ -0,0 +1,38 @@
+#ifndef JNIMSGPACK_H
+#define JNIMSGPACK_H
+
+#include "jnioutput.h"
+
+#include <core/value.h>
+
+#include <cstddef>
+#include <string>
+
+// MessagePack encoding of messages, the binary alternative to jnijson.
+// Integers use the smallest encoding, Float and Double keep their width,
+// objects are written as nil.
+
+// Appends value to out
+void writeMsgPack(Value const & value, JniOutput & out);
+
+inline void writeMsgPack(Value const & value, std::string & out)
+{
+    JniOutput o(out);
+    writeMsgPack(value, o);
+}
+
+// Parses the document in [data, data + size), returns false and leaves
+// value untouched on malformed input
+bool readMsgPack(char const * data, size_t size, Value & value);
+
+// Messages are maps and batches arrays, neither header byte can start a
+// JSON document
+inline bool isMsgPack(char const * data, size_t size)
+{
+    if (size == 0)
+        return false;
+    unsigned char c = static_cast<unsigned char>(*data);
+    return (c & 0xe0) == 0x80 || (c >= 0xdc && c <= 0xdf);
+}
+
+#endif // JNIMSGPACK_H
@@ -0,0 +1,72 @@
+#ifndef JNIOUTPUT_H
+#define JNIOUTPUT_H
+
+#include <cstddef>
+#include <string>
+
+// Byte sink of the message writers. Unbounded it just appends to buffer.
+// With a chunk size, buffer is handed to chunk() and cleared each time it
+// fills up, so the writer never holds more than a chunk of the message.
+class JniOutput
+{
+public:
+    explicit JniOutput(std::string & buffer)
+        : buffer_(buffer)
+        , chunkSize_(0)
+    {
+    }
+
+    virtual ~JniOutput() {}
+
+    void push_back(char c)
+    {
+        if (chunkSize_ && buffer_.size() >= chunkSize_)
+            drain();
+        buffer_.push_back(c);
+    }
+
+    void append(char const * data, size_t n)
+    {
+        while (chunkSize_ && buffer_.size() + n > chunkSize_) {
+            size_t m = chunkSize_ - buffer_.size();
+            buffer_.append(data, m);
+            data += m;
+            n -= m;
+            drain();
+        }
+        buffer_.append(data, n);
+    }
+
+    // Hands over the rest as the last chunk, buffer keeps it
+    void finish()
+    {
+        chunk(buffer_.data(), buffer_.size(), true);
+    }
+
+protected:
+    JniOutput(std::string & buffer, size_t chunkSize)
+        : buffer_(buffer)
+        , chunkSize_(chunkSize)
+    {
+    }
+
+    virtual void chunk(char const * data, size_t size, bool last)
+    {
+        (void) data;
+        (void) size;
+        (void) last;
+    }
+
+private:
+    void drain()
+    {
+        chunk(buffer_.data(), buffer_.size(), false);
+        buffer_.clear();
+    }
+
+private:
+    std::string & buffer_;
+    size_t chunkSize_;
+};
+
+#endif // JNIOUTPUT_H
@@ -4,64 +4,84 @@
 
 #include <core/metaobject.h>
 
-JniProxyObject::JniProxyObject(JNIEnv * env, Map &&classinfo)
+JniProxyObject::JniProxyObject(JNIEnv * env, Map &&classinfo, std::shared_ptr<std::recursive_mutex> channelMutex)
     : ProxyObject(std::move(classinfo))
-    , env_(env)
+    , channelMutex_(std::move(channelMutex))
 {
     handle_ = proxyObjectClass(env).create(reinterpret_cast<jlong>(this));
     handle_ = env->NewGlobalRef(handle_);
+    index_.build(*metaObj());
 }
 
 JniProxyObject::~JniProxyObject()
 {
-    env_->DeleteGlobalRef(handle_);
+    env()->DeleteGlobalRef(handle_);
     handle_ = nullptr;
 }
 
 jobject JniProxyObject::readProperty(jstring property)
 {
-    MetaProperty const * mp = this->property(JString(env_, property).str());
-    if (mp) {
-        Array emptyArray;
-        return JniVariant::fromValue(mp->read(this));
+    size_t index = index_.propertyIndex(JString(env(), property).str());
+    if (index < metaObj()->propertyCount()) {
+        return JniVariant::fromValue(metaObj()->property(index).read(this));
     }
     return nullptr;
 }
 
 jboolean JniProxyObject::writeProperty(jstring property, jobject value)
 {
-    MetaProperty const * mp = this->property(JString(env_, property).str());
-    if (mp) {
-        Array emptyArray;
-        return mp->write(this, JniVariant::toValue(value));
+    size_t index = index_.propertyIndex(JString(env(), property).str());
+    if (index < metaObj()->propertyCount()) {
+        return metaObj()->property(index).write(this, JniVariant::toValue(value));
     }
     return false;
 }
 
+jint JniProxyObject::methodIndex(jobject method)
+{
+    // java.lang.reflect.Method objects are not unique, their jmethodID is
+    jmethodID id = env()->FromReflectedMethod(method);
+    std::lock_guard<std::mutex> l(mutex_);
+    auto it = methodIndexes_.find(id);
+    if (it == methodIndexes_.end()) {
+        JniObjectMetaObject mo(env());
+        JniMetaMethod md(&mo, method);
+        it = methodIndexes_.emplace(id, index_.methodIndex(md)).first;
+    }
+    return static_cast<jint>(it->second);
+}
+
 jboolean JniProxyObject::invokeMethod(jobject method, jobjectArray args, jobject onResult)
+{
+    return invokeMethod(methodIndex(method), args, onResult);
+}
+
+jboolean JniProxyObject::invokeMethod(jint methodIndex, jobjectArray args, jobject onResult)
 {
     MetaObject const * meta = metaObj();
-    JniObjectMetaObject mo(env_);
-    JniMetaMethod md(reinterpret_cast<JniMetaObject*>(&mo), method);
-    for (size_t i = 0; i < meta->methodCount(); ++i) {
-        if (md == meta->method(i)) {
-            Array emptyArray;
-            return md.invoke(this, std::move(JniVariant::toValue(args).toArray(emptyArray)),
-                                  [onResult] (Value && result) {
-                onResultClass().apply(onResult, JniVariant::fromValue(result));
-            });
-        }
-    }
-    return false;
+    size_t index = static_cast<size_t>(methodIndex);
+    if (methodIndex < 0 || index >= meta->methodCount())
+        return false;
+    Array emptyArray;
+    Array array;
+    if (args)
+        array = std::move(JniVariant::toValue(args).toArray(emptyArray));
+    // the reply comes later, from another native frame
+    JSharedRef handler = newSharedRef(env(), onResult);
+    return meta->method(index).invoke(this, std::move(array), [handler] (Value && result) {
+        OnResultClass & orc = onResultClass();
+        JLocalObjectRef r(orc.env(), JniVariant::fromValue(result));
+        orc.apply(handler.get(), r);
+    });
 }
 
 static void handleSignal(void * handler, Object const * object, size_t index, Array && args)
 {
     jobject jhandler = static_cast<jobject>(handler);
     jobject proxy = static_cast<jobject>(static_cast<JniProxyObject const*>(object)->handle());
-    signalHandlerClass().apply(jhandler, proxy,
-                               static_cast<int>(index),
-                               static_cast<jobjectArray>(JniVariant::fromValue(args)));
+    SignalHandlerClass & shc = signalHandlerClass();
+    JLocalRef<jobjectArray> jargs(shc.env(), static_cast<jobjectArray>(JniVariant::fromValue(args)));
+    shc.apply(jhandler, proxy, static_cast<int>(index), jargs);
 }
 
 jboolean JniProxyObject::connect(jint signalIndex, jobject handler)
@@ -73,9 +93,9 @@ jboolean JniProxyObject::connect(jint signalIndex, jobject handler)
     MetaMethod const & md = meta->method(index);
     if (!md.isSignal())
         return false;
-    signalHandlerClass(env_);
+    signalHandlerClass(env());
     return meta->connect(MetaObject::Connection(this, index,
-                                         JniVariant::registerObject(env_, handler), handleSignal));
+                                         JniVariant::registerObject(env(), handler), handleSignal));
 }
 
 jboolean JniProxyObject::disconnect(jint signalIndex, jobject handler)
@@ -88,7 +108,7 @@ jboolean JniProxyObject::disconnect(jint signalIndex, jobject handler)
     if (!md.isSignal())
         return false;
     return meta->disconnect(MetaObject::Connection(this, index,
-                                         JniVariant::deregisterObject(env_, handler), handleSignal));
+                                         JniVariant::deregisterObject(env(), handler), handleSignal));
 }
 
 ProxyObjectClass::ProxyObjectClass(JNIEnv *env)
@@ -99,7 +119,7 @@ ProxyObjectClass::ProxyObjectClass(JNIEnv *env)
 
 jobject ProxyObjectClass::create(jlong handle)
 {
-    return env_->NewObject(clazz_, create_, handle);
+    return env()->NewObject(clazz_, create_, handle);
 }
 
 OnResultClass::OnResultClass(JNIEnv *env)
@@ -110,7 +130,7 @@ OnResultClass::OnResultClass(JNIEnv *env)
 
 void OnResultClass::apply(jobject resp, jobject result)
 {
-    env_->CallVoidMethod(resp, apply_, result);
+    env()->CallVoidMethod(resp, apply_, result);
 }
 
 OnResultClass &onResultClass(JNIEnv *env)
@@ -127,7 +147,7 @@ SignalHandlerClass::SignalHandlerClass(JNIEnv *env)
 
 void SignalHandlerClass::apply(jobject resp, jobject object, jint signalIndex, jobjectArray args)
 {
-    env_->CallVoidMethod(resp, apply_, object, signalIndex, args);
+    env()->CallVoidMethod(resp, apply_, object, signalIndex, args);
 }
 
 SignalHandlerClass &signalHandlerClass(JNIEnv *env)
@@ -2,13 +2,18 @@
 #define JNIPROXYOBJECT_H
 
 #include "jniclass.h"
+#include "jnimeta.h"
 
 #include <core/proxyobject.h>
 
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
 class JniProxyObject : public ProxyObject
 {
 public:
-    JniProxyObject(JNIEnv * env, Map &&classinfo);
+    JniProxyObject(JNIEnv * env, Map &&classinfo, std::shared_ptr<std::recursive_mutex> channelMutex);
 
     ~JniProxyObject() override;
 
@@ -21,15 +26,25 @@ private:
 
     jboolean writeProperty(jstring property, jobject value);
 
+    jint methodIndex(jobject method);
+
     jboolean invokeMethod(jobject method, jobjectArray args, jobject onResult);
 
+    jboolean invokeMethod(jint methodIndex, jobjectArray args, jobject onResult);
+
     jboolean connect(jint signalIndex, jobject handler);
 
     jboolean disconnect(jint signalIndex, jobject handler);
 
+    JNIEnv * env() const { return jniEnv(); }
+
 private:
-    JNIEnv * env_;
+    // Lock of the owning channel, see JniChannel
+    std::shared_ptr<std::recursive_mutex> channelMutex_;
     jobject handle_;
+    JniMetaIndex index_;
+    std::mutex mutex_;
+    std::unordered_map<jmethodID, size_t> methodIndexes_;
 };
 
 struct ProxyObjectClass : Class
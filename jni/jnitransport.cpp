@@ -1,30 +1,469 @@
 #include "jniclass.h"
+#include "jnijson.h"
+#include "jnimsgpack.h"
 #include "jnitransport.h"
 
 #include <core/value.h>
 
+// Leading whitespace is valid JSON to any peer, Hybridge peers that decode
+// MessagePack start their JSON with this one
+static char const MsgPackMark = '\t';
+
 JniTransport::JniTransport(JNIEnv * env, jobject handle)
-    : env_(env)
-    , handle_(env_->NewWeakGlobalRef(handle))
+    : handle_(env->NewWeakGlobalRef(handle))
+    , bufferMode_(false)
+    , wireFormat_(Json)
+    , peerMsgPack_(false)
+    , directBuffer_(nullptr)
+    , directData_(nullptr)
+    , directCapacity_(0)
+    , chunkSize_(0)
+    , resetBuffer_(false)
+    , sendDepth_(0)
+    , batchLimit_(0)
+    , batchDepth_(0)
+    , queueLimit_(0)
+    , stopping_(false)
+    , running_(false)
+    , overflowed_(false)
 {
-    sendMessage_ = env->GetMethodID(env->GetObjectClass(handle), "sendMessage", "(Ljava/lang/String;)V");
 }
 
 JniTransport::~JniTransport()
 {
-    env_->DeleteGlobalRef(handle_);
+    // whatever is still queued would go to a collected transport
+    stopWorker(false);
+    env()->DeleteWeakGlobalRef(handle_);
+    if (directBuffer_)
+        env()->DeleteGlobalRef(directBuffer_);
 }
 
+// Hands buffer to Transport.sendChunk each time it fills up
+class JniTransport::ChunkOutput : public JniOutput
+{
+public:
+    ChunkOutput(JniTransport & transport, std::string & buffer)
+        : JniOutput(buffer, transport.chunkSize_)
+        , transport_(transport)
+        , buffer_(buffer)
+        , failed_(false)
+    {
+    }
+
+protected:
+    void chunk(char const *, size_t size, bool last) override
+    {
+        // no more calls into java once one has thrown
+        if (failed_)
+            return;
+        jobject buffer = transport_.directBuffer(buffer_);
+        if (buffer)
+            transportClass().sendChunk(transport_.handle_, buffer, static_cast<jint>(size), last);
+        failed_ = buffer == nullptr || transport_.env()->ExceptionCheck();
+        transport_.releaseBuffer(buffer_, buffer);
+    }
+
+private:
+    JniTransport & transport_;
+    std::string & buffer_;
+    bool failed_;
+};
+
 void JniTransport::sendMessage(Message &&message)
 {
-    std::string json = Value::toJson(Value(const_cast<Message &>(message)));
-    env_->CallVoidMethod(handle_, sendMessage_, env_->NewStringUTF(json.c_str()));
-    JThrowable::check(env_);
+    std::lock_guard<std::recursive_mutex> sending(sendMutex_);
+    Value value;
+    {
+        std::lock_guard<std::mutex> lock(batchMutex_);
+        // also queue behind a batch left over by a failed flush, to keep order
+        if (batchLimit_ && (batchDepth_ || !batch_.empty())) {
+            batch_.push_back(std::move(message));
+            if (batchDepth_ && batch_.size() < batchLimit_)
+                return;
+            value = takeBatch();
+        } else {
+            value = Value(std::move(message));
+        }
+    }
+    deliver(value);
+    JThrowable::check(env());
+}
+
+void JniTransport::deliver(Value &value)
+{
+    if (!post(value))
+        send(value);
+}
+
+void JniTransport::send(const Value &value)
+{
+    if (sendDepth_) {
+        // reentered from the java call of an outer send, which may still
+        // be writing its message into buffer_
+        std::string buffer;
+        ++sendDepth_;
+        send(value, buffer);
+        --sendDepth_;
+        return;
+    }
+    if (resetBuffer_.exchange(false)) {
+        // drop what earlier whole messages grew the buffer to
+        std::string().swap(buffer_);
+        buffer_.reserve(chunkSize_);
+    }
+    buffer_.clear();
+    ++sendDepth_;
+    send(value, buffer_);
+    --sendDepth_;
+}
+
+void JniTransport::send(const Value &value, std::string &buffer)
+{
+    if (!bufferMode_) {
+        writeJson(value, buffer);
+        JLocalRef<jstring> jmsg(env(), newUtf8String(env(), buffer));
+        transportClass().sendMessage(handle_, jmsg);
+        return;
+    }
+    int format = wireFormat_;
+    bool msgPack = format != Json && peerMsgPack_;
+    bool mark = format != Json && !msgPack;
+    if (chunkSize_) {
+        ChunkOutput out(*this, buffer);
+        if (mark)
+            out.push_back(MsgPackMark);
+        if (msgPack)
+            writeMsgPack(value, out);
+        else
+            writeJson(value, out);
+        out.finish();
+        return;
+    }
+    if (mark)
+        buffer.push_back(MsgPackMark);
+    if (msgPack)
+        writeMsgPack(value, buffer);
+    else
+        writeJson(value, buffer);
+    jobject direct = directBuffer(buffer);
+    if (direct)
+        transportClass().sendBuffer(handle_, direct, static_cast<jint>(buffer.size()));
+    releaseBuffer(buffer, direct);
+}
+
+void JniTransport::setBatchLimit(size_t limit)
+{
+    std::lock_guard<std::recursive_mutex> sending(sendMutex_);
+    Value value;
+    {
+        std::lock_guard<std::mutex> lock(batchMutex_);
+        batchLimit_ = limit;
+        if (limit || batch_.empty())
+            return;
+        value = takeBatch();
+    }
+    deliver(value);
+}
+
+void JniTransport::beginBatch()
+{
+    std::lock_guard<std::mutex> lock(batchMutex_);
+    ++batchDepth_;
+}
+
+void JniTransport::endBatch()
+{
+    {
+        std::lock_guard<std::mutex> lock(batchMutex_);
+        if (--batchDepth_ || batch_.empty())
+            return;
+    }
+    std::lock_guard<std::recursive_mutex> sending(sendMutex_);
+    Value value;
+    {
+        std::lock_guard<std::mutex> lock(batchMutex_);
+        // flushed or batching again meanwhile
+        if (batchDepth_ || batch_.empty())
+            return;
+        value = takeBatch();
+    }
+    // an exception pending here, e.g. from a handler of the incoming
+    // message, is put aside for the java calls of the flush and restored
+    JNIEnv * env = this->env();
+    JLocalRef<jthrowable> pending(env, env->ExceptionOccurred());
+    if (pending)
+        env->ExceptionClear();
+    deliver(value);
+    if (pending) {
+        // the first exception wins, a second one is only reported
+        JThrowable::clear(env);
+        env->Throw(pending);
+    }
+}
+
+Value JniTransport::takeBatch()
+{
+    std::vector<Message> batch;
+    batch.swap(batch_);
+    if (batch.size() == 1)
+        return Value(std::move(batch.front()));
+    Array array;
+    array.reserve(batch.size());
+    for (Message & message : batch)
+        array.emplace_back(std::move(message));
+    return Value(std::move(array));
+}
+
+bool JniTransport::setSendQueue(size_t limit)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        if (std::this_thread::get_id() == workerId_)
+            return false;
+    }
+    // concurrent calls would both stop and then both start a worker
+    std::lock_guard<std::mutex> config(configMutex_);
+    stopWorker(true);
+    if (limit == 0)
+        return true;
+    // sends on the calling thread hold the send lock, once it is free
+    // buffer_ belongs to the worker
+    std::lock_guard<std::recursive_mutex> sending(sendMutex_);
+    if (sendDepth_)
+        return false;
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    queueLimit_ = limit;
+    stopping_ = false;
+    running_ = true;
+    worker_ = std::thread(&JniTransport::sendLoop, this);
+    workerId_ = worker_.get_id();
+    return true;
+}
+
+void JniTransport::stopWorker(bool drain)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        if (!drain)
+            queue_.clear();
+        stopping_ = true;
+        queueChanged_.notify_all();
+    }
+    if (worker_.joinable())
+        worker_.join();
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    workerId_ = std::thread::id();
+}
+
+bool JniTransport::post(Value &value)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        // the peer misses a message, later ones would not make sense to it
+        if (overflowed_)
+            return true;
+        if (!running_)
+            return false;
+        if (queue_.size() < queueLimit_) {
+            queue_.push_back(std::move(value));
+            queueChanged_.notify_all();
+            return true;
+        }
+        overflowed_ = true;
+    }
+    // never wait for space, the sender may hold a channel lock that the
+    // worker needs to get on through a loopback transport
+    transportClass().sendQueueFull(handle_);
+    return true;
+}
+
+void JniTransport::sendLoop()
+{
+    JNIEnv * env = this->env();
+    std::unique_lock<std::mutex> lock(queueMutex_);
+    while (true) {
+        queueChanged_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+        if (queue_.empty())
+            break;
+        Value value = std::move(queue_.front());
+        queue_.pop_front();
+        queueChanged_.notify_all();
+        lock.unlock();
+        {
+            // an attached thread never returns to java to free local refs
+            JLocalFrame frame(env);
+            // no send lock, only the worker sends while it runs
+            send(value);
+            jthrowable e = env->ExceptionOccurred();
+            if (e) {
+                env->ExceptionClear();
+                transportClass().sendFailed(handle_, e);
+                JThrowable::clear(env);
+            }
+        }
+        lock.lock();
+    }
+    running_ = false;
+    queueChanged_.notify_all();
+}
+
+void JniTransport::setBufferMode(bool enable)
+{
+    bufferMode_ = enable;
+}
+
+void JniTransport::setWireFormat(WireFormat format)
+{
+    peerMsgPack_ = format == MsgPack;
+    wireFormat_ = format;
+}
+
+void JniTransport::setChunkSize(size_t size)
+{
+    // buffer_ may be in use by a send further up the stack, the next
+    // outermost send resizes it
+    chunkSize_ = size;
+    resetBuffer_ = true;
 }
 
-void JniTransport::messageReceived(jstring message)
+jobject JniTransport::directBuffer(std::string &buffer)
 {
-    Value v = Value::fromJson(JString(env_, message));
+    if (&buffer != &buffer_)
+        return env()->NewDirectByteBuffer(&buffer[0], static_cast<jlong>(buffer.capacity()));
+    if (directBuffer_ && directData_ == buffer_.data() && directCapacity_ == buffer_.capacity())
+        return directBuffer_;
+    if (directBuffer_)
+        env()->DeleteGlobalRef(directBuffer_);
+    directBuffer_ = nullptr;
+    JLocalRef<jobject> local(env(), env()->NewDirectByteBuffer(&buffer_[0], static_cast<jlong>(buffer_.capacity())));
+    if (local == nullptr)
+        return nullptr;
+    directBuffer_ = env()->NewGlobalRef(local);
+    directData_ = buffer_.data();
+    directCapacity_ = buffer_.capacity();
+    return directBuffer_;
+}
+
+void JniTransport::releaseBuffer(const std::string &buffer, jobject direct)
+{
+    if (direct && &buffer != &buffer_)
+        env()->DeleteLocalRef(direct);
+}
+
+void JniTransport::setMutex(std::shared_ptr<std::recursive_mutex> mutex)
+{
+    std::atomic_store(&mutex_, std::move(mutex));
+}
+
+std::shared_ptr<std::recursive_mutex> JniTransport::mutex() const
+{
+    return std::atomic_load(&mutex_);
+}
+
+JniTransport::ReceiveResult JniTransport::messageReceived(jstring message)
+{
+    // parsed straight from the pinned chars, the parser makes no JNI calls
+    Value v;
+    jsize length = env()->GetStringLength(message);
+    jchar const * chars = env()->GetStringCritical(message, nullptr);
+    if (chars == nullptr)
+        return BadMessage;
+    bool ok = readJson(chars, static_cast<size_t>(length), v);
+    env()->ReleaseStringCritical(message, chars);
+    if (!ok)
+        return BadMessage;
+    dispatch(v);
+    return Dispatched;
+}
+
+JniTransport::ReceiveResult JniTransport::messageReceived(jobject buffer, jint offset, jint length)
+{
+    char const * data = static_cast<char const *>(env()->GetDirectBufferAddress(buffer));
+    jlong capacity = env()->GetDirectBufferCapacity(buffer);
+    if (data == nullptr || offset < 0 || length < 0 || static_cast<jlong>(offset) + length > capacity)
+        return BadBuffer;
+    data += offset;
+    bool msgPack = isMsgPack(data, static_cast<size_t>(length));
+    Value v;
+    bool ok = msgPack ? readMsgPack(data, static_cast<size_t>(length), v)
+                      : readJson(data, static_cast<size_t>(length), v);
+    if (!ok)
+        return BadMessage;
+    peerMsgPack_ = msgPack || *data == MsgPackMark;
+    dispatch(v);
+    return Dispatched;
+}
+
+void JniTransport::dispatch(Value &message)
+{
+    // replies to a batch go out as one batch too
+    Batch batch(this);
     Map emptyMap;
-    return Transport::messageReceived(std::move(v.toMap(emptyMap)));
+    if (!message.isArray()) {
+        Transport::messageReceived(std::move(message.toMap(emptyMap)));
+        return;
+    }
+    Array emptyArray;
+    for (Value & m : message.toArray(emptyArray))
+        Transport::messageReceived(std::move(m.toMap(emptyMap)));
+}
+
+JniTransport::Batch::Batch(JniTransport *transport)
+    : transports_(1, transport)
+{
+    transport->beginBatch();
+}
+
+JniTransport::Batch::Batch(const std::vector<JniTransport *> &transports)
+    : transports_(transports)
+{
+    for (JniTransport * t : transports_)
+        t->beginBatch();
+}
+
+JniTransport::Batch::~Batch()
+{
+    for (JniTransport * t : transports_)
+        t->endBatch();
+}
+
+TransportClass::TransportClass(JNIEnv *env)
+    : Class(env, "com/tal/hybridge/Transport")
+{
+    sendMessage_ = env->GetMethodID(clazz_, "sendMessage", "(Ljava/lang/String;)V");
+    sendBuffer_ = env->GetMethodID(clazz_, "sendBuffer", "(Ljava/nio/ByteBuffer;I)V");
+    sendChunk_ = env->GetMethodID(clazz_, "sendChunk", "(Ljava/nio/ByteBuffer;IZ)V");
+    sendFailed_ = env->GetMethodID(clazz_, "sendFailed", "(Ljava/lang/Throwable;)V");
+    sendQueueFull_ = env->GetMethodID(clazz_, "sendQueueFull", "()V");
+}
+
+void TransportClass::sendMessage(jobject transport, jstring message)
+{
+    env()->CallVoidMethod(transport, sendMessage_, message);
+}
+
+void TransportClass::sendBuffer(jobject transport, jobject buffer, jint length)
+{
+    env()->CallVoidMethod(transport, sendBuffer_, buffer, length);
+}
+
+void TransportClass::sendFailed(jobject transport, jthrowable error)
+{
+    env()->CallVoidMethod(transport, sendFailed_, error);
+}
+
+void TransportClass::sendQueueFull(jobject transport)
+{
+    env()->CallVoidMethod(transport, sendQueueFull_);
+}
+
+void TransportClass::sendChunk(jobject transport, jobject buffer, jint length, bool last)
+{
+    env()->CallVoidMethod(transport, sendChunk_, buffer, length, static_cast<jboolean>(last));
+}
+
+TransportClass &transportClass(JNIEnv *env)
+{
+    static TransportClass c(env);
+    return c;
 }
@@ -3,11 +3,50 @@
 
 #include <core/transport.h>
 
+#include "jniclass.h"
+
 #include <jni.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 class JniTransport : public Transport
 {
 public:
+    // Encoding of outgoing messages in buffer mode, String mode is always
+    // JSON. Incoming buffers are decoded by their first byte. MsgPack and
+    // Auto mark the JSON they send as coming from a peer that decodes
+    // MessagePack, and follow what the peer sends: MessagePack or marked
+    // JSON switch to MessagePack, plain JSON back to JSON.
+    enum WireFormat
+    {
+        Json,
+        // Starts with MessagePack
+        MsgPack,
+        // Starts with JSON
+        Auto
+    };
+
+    // Sends of the transports are batched while a Batch lives, see
+    // setBatchLimit()
+    class Batch
+    {
+    public:
+        explicit Batch(JniTransport * transport);
+        explicit Batch(std::vector<JniTransport *> const & transports);
+        Batch(Batch const &) = delete;
+        Batch & operator=(Batch const &) = delete;
+        ~Batch();
+    private:
+        std::vector<JniTransport *> transports_;
+    };
+
     JniTransport(JNIEnv * env, jobject handle);
 
     ~JniTransport() override;
@@ -16,14 +55,147 @@ public:
 public:
     virtual void sendMessage(Message &&message) override;
 
+    // Outcome of an incoming message, nothing is dispatched on errors
+    enum ReceiveResult
+    {
+        Dispatched,
+        // not a direct buffer or the range is out of bounds
+        BadBuffer,
+        // not a message in any wire format
+        BadMessage
+    };
+
 protected:
-    void messageReceived(jstring message);
+    ReceiveResult messageReceived(jstring message);
+
+    // Parses in place from a direct buffer
+    ReceiveResult messageReceived(jobject buffer, jint offset, jint length);
+
+    // A message, or a batch of them as an array
+    void dispatch(Value & message);
 
 private:
+    class ChunkOutput;
+    friend class JniChannel;
     friend struct JTransport;
-    JNIEnv * env_;
+
+    JNIEnv * env() const { return jniEnv(); }
+
+    // Lock of the connected channel, see JniChannel
+    void setMutex(std::shared_ptr<std::recursive_mutex> mutex);
+
+    std::shared_ptr<std::recursive_mutex> mutex() const;
+
+    // Outgoing messages are written into buffer_ and handed over as a
+    // direct ByteBuffer over it instead of a String
+    void setBufferMode(bool enable);
+
+    void setWireFormat(WireFormat format);
+
+    // In buffer mode, messages go out in pieces of at most size bytes
+    // through Transport.sendChunk, 0 sends them whole
+    void setChunkSize(size_t size);
+
+    // Messages sent during a channel timer event or while handling an
+    // incoming message are queued, and go out as one array when that ends
+    // or once limit messages are queued. 0 sends each message right away.
+    void setBatchLimit(size_t limit);
+
+    void beginBatch();
+
+    void endBatch();
+
+    // Called with the batch lock
+    Value takeBatch();
+
+    // With a limit, serialization and the java call happen in order on a
+    // worker thread. At most limit messages or batches wait. The first one
+    // beyond that is reported through Transport.sendQueueFull, and from
+    // then on nothing more is sent, queued messages still go out. Java
+    // exceptions go to Transport.sendFailed on the worker. 0 stops the
+    // worker once the queue is drained. False when called on the worker
+    // itself or from within a send, the queue is stopped then.
+    bool setSendQueue(size_t limit);
+
+    void stopWorker(bool drain);
+
+    // Queues value for the worker, or drops it once the queue overflowed.
+    // False without a worker.
+    bool post(Value & value);
+
+    void sendLoop();
+
+    // Posts value or sends it right away, called with the send lock
+    void deliver(Value & value);
+
+    // Writes value in the current mode, leaves java exceptions pending
+    void send(Value const & value);
+
+    void send(Value const & value, std::string & buffer);
+
+    // Direct ByteBuffer over buffer, cached for buffer_, and a local ref
+    // to release for the buffer of a nested send
+    jobject directBuffer(std::string & buffer);
+
+    void releaseBuffer(std::string const & buffer, jobject direct);
+
+private:
+    std::shared_ptr<std::recursive_mutex> mutex_;
     jobject handle_;
+    std::atomic<bool> bufferMode_;
+    std::atomic<int> wireFormat_;
+    // The peer decodes MessagePack, as far as known
+    std::atomic<bool> peerMsgPack_;
+    // Channels connected to the same transport send under different locks,
+    // this one keeps their messages in order. Without a worker it is held
+    // across the java call. Recursive as a java transport may deliver to a
+    // peer that replies through this transport within the call. Such a
+    // nested send writes into a buffer of its own, buffer_ belongs to the
+    // outermost one. The worker sends without it, nobody else sends then.
+    std::recursive_mutex sendMutex_;
+    std::string buffer_;
+    // Global ref wrapping buffer_, recreated when buffer_ reallocates
+    jobject directBuffer_;
+    char const * directData_;
+    size_t directCapacity_;
+    std::atomic<size_t> chunkSize_;
+    std::atomic<bool> resetBuffer_;
+    // Sends in progress on the sending thread
+    size_t sendDepth_;
+    // Guards the batch state, never held across a java call
+    std::mutex batchMutex_;
+    size_t batchLimit_;
+    size_t batchDepth_;
+    std::vector<Message> batch_;
+    std::mutex queueMutex_;
+    std::condition_variable queueChanged_;
+    std::deque<Value> queue_;
+    size_t queueLimit_;
+    bool stopping_;
+    bool running_;
+    bool overflowed_;
+    // Serializes setSendQueue
+    std::mutex configMutex_;
+    std::thread worker_;
+    std::thread::id workerId_;
+};
+
+struct TransportClass : Class
+{
+    TransportClass(JNIEnv * env);
+    void sendMessage(jobject transport, jstring message);
+    void sendBuffer(jobject transport, jobject buffer, jint length);
+    void sendChunk(jobject transport, jobject buffer, jint length, bool last);
+    void sendFailed(jobject transport, jthrowable error);
+    void sendQueueFull(jobject transport);
+private:
     jmethodID sendMessage_;
+    jmethodID sendBuffer_;
+    jmethodID sendChunk_;
+    jmethodID sendFailed_;
+    jmethodID sendQueueFull_;
 };
 
+TransportClass & transportClass(JNIEnv * env = nullptr);
+
 #endif // JNITRANSPORT_H
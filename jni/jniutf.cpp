@@ -0,0 +1,186 @@
+#include "jniutf.h"
+
+#include <cstdint>
+#include <memory>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define JNIUTF_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define JNIUTF_NEON
+#endif
+
+enum : jchar { Replacement = 0xfffd };
+
+// Strings up to this length are copied out with GetStringRegion instead of
+// pinning them with GetStringCritical
+enum { RegionLength = 128 };
+
+// Copies the leading run of ASCII units, 8 at a time
+static inline size_t asciiRun(jchar const * src, size_t n, char * dst)
+{
+    size_t i = 0;
+#if defined(JNIUTF_SSE2)
+    __m128i const mask = _mm_set1_epi16(static_cast<short>(0xff80));
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), _mm_setzero_si128())) != 0xffff)
+            break;
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(v, v));
+    }
+#elif defined(JNIUTF_NEON)
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t v = vld1q_u16(src + i);
+        if (vmaxvq_u16(v) >= 0x80)
+            break;
+        vst1_u8(reinterpret_cast<uint8_t *>(dst + i), vmovn_u16(v));
+    }
+#endif
+    for (; i < n && src[i] < 0x80; ++i)
+        dst[i] = static_cast<char>(src[i]);
+    return i;
+}
+
+// Widens the leading run of ASCII bytes, 16 at a time
+static inline size_t asciiRun(char const * src, size_t n, jchar * dst)
+{
+    size_t i = 0;
+#if defined(JNIUTF_SSE2)
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i));
+        if (_mm_movemask_epi8(v) != 0)
+            break;
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 8), _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+    }
+#elif defined(JNIUTF_NEON)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<uint8_t const *>(src + i));
+        if (vmaxvq_u8(v) >= 0x80)
+            break;
+        vst1q_u16(dst + i, vmovl_u8(vget_low_u8(v)));
+        vst1q_u16(dst + i + 8, vmovl_u8(vget_high_u8(v)));
+    }
+#endif
+    for (; i < n && static_cast<unsigned char>(src[i]) < 0x80; ++i)
+        dst[i] = static_cast<jchar>(src[i]);
+    return i;
+}
+
+size_t utf16ToUtf8(const jchar *src, size_t n, char *dst)
+{
+    char * d = dst;
+    size_t i = 0;
+    while (i < n) {
+        size_t a = asciiRun(src + i, n - i, d);
+        i += a;
+        d += a;
+        if (i == n)
+            break;
+        uint32_t c = src[i++];
+        if (c < 0x800) {
+            *d++ = static_cast<char>(0xc0 | (c >> 6));
+            *d++ = static_cast<char>(0x80 | (c & 0x3f));
+            continue;
+        }
+        if (c >= 0xd800 && c < 0xdc00 && i < n && src[i] >= 0xdc00 && src[i] < 0xe000) {
+            c = 0x10000 + ((c - 0xd800) << 10) + (src[i++] - 0xdc00);
+            *d++ = static_cast<char>(0xf0 | (c >> 18));
+            *d++ = static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+            *d++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+            *d++ = static_cast<char>(0x80 | (c & 0x3f));
+            continue;
+        }
+        // lone surrogates
+        if (c >= 0xd800 && c < 0xe000)
+            c = Replacement;
+        *d++ = static_cast<char>(0xe0 | (c >> 12));
+        *d++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+        *d++ = static_cast<char>(0x80 | (c & 0x3f));
+    }
+    return static_cast<size_t>(d - dst);
+}
+
+static inline bool isContinuation(char c)
+{
+    return (static_cast<unsigned char>(c) & 0xc0) == 0x80;
+}
+
+size_t utf8ToUtf16(const char *src, size_t n, jchar *dst)
+{
+    jchar * d = dst;
+    size_t i = 0;
+    while (i < n) {
+        size_t a = asciiRun(src + i, n - i, d);
+        i += a;
+        d += a;
+        if (i == n)
+            break;
+        uint32_t c = static_cast<unsigned char>(src[i]);
+        if (c >= 0xc2 && c < 0xe0 && i + 1 < n && isContinuation(src[i + 1])) {
+            *d++ = static_cast<jchar>(((c & 0x1f) << 6) | (src[i + 1] & 0x3f));
+            i += 2;
+        } else if (c >= 0xe0 && c < 0xf0 && i + 2 < n
+                   && isContinuation(src[i + 1]) && isContinuation(src[i + 2])) {
+            c = ((c & 0x0f) << 12) | ((src[i + 1] & 0x3f) << 6) | (src[i + 2] & 0x3f);
+            // overlong or surrogate
+            if (c < 0x800 || (c >= 0xd800 && c < 0xe000)) {
+                *d++ = Replacement;
+                ++i;
+            } else {
+                *d++ = static_cast<jchar>(c);
+                i += 3;
+            }
+        } else if (c >= 0xf0 && c < 0xf5 && i + 3 < n && isContinuation(src[i + 1])
+                   && isContinuation(src[i + 2]) && isContinuation(src[i + 3])) {
+            c = ((c & 0x07) << 18) | ((src[i + 1] & 0x3f) << 12)
+                    | ((src[i + 2] & 0x3f) << 6) | (src[i + 3] & 0x3f);
+            if (c < 0x10000 || c > 0x10ffff) {
+                *d++ = Replacement;
+                ++i;
+            } else {
+                c -= 0x10000;
+                *d++ = static_cast<jchar>(0xd800 | (c >> 10));
+                *d++ = static_cast<jchar>(0xdc00 | (c & 0x3ff));
+                i += 4;
+            }
+        } else {
+            *d++ = Replacement;
+            ++i;
+        }
+    }
+    return static_cast<size_t>(d - dst);
+}
+
+std::string utf8String(JNIEnv *env, jstring str)
+{
+    std::string out;
+    if (str == nullptr)
+        return out;
+    jsize n = env->GetStringLength(str);
+    out.resize(static_cast<size_t>(n) * 3);
+    if (n <= RegionLength) {
+        jchar chars[RegionLength];
+        env->GetStringRegion(str, 0, n, chars);
+        out.resize(utf16ToUtf8(chars, static_cast<size_t>(n), &out[0]));
+    } else {
+        jchar const * chars = env->GetStringCritical(str, nullptr);
+        if (chars == nullptr)
+            return std::string();
+        size_t m = utf16ToUtf8(chars, static_cast<size_t>(n), &out[0]);
+        env->ReleaseStringCritical(str, chars);
+        out.resize(m);
+    }
+    return out;
+}
+
+jstring newUtf8String(JNIEnv *env, const char *str, size_t n)
+{
+    if (n <= RegionLength) {
+        jchar chars[RegionLength];
+        return env->NewString(chars, static_cast<jsize>(utf8ToUtf16(str, n, chars)));
+    }
+    std::unique_ptr<jchar[]> chars(new jchar[n]);
+    return env->NewString(chars.get(), static_cast<jsize>(utf8ToUtf16(str, n, chars.get())));
+}
@@ -0,0 +1,30 @@
+#ifndef JNIUTF_H
+#define JNIUTF_H
+
+#include <jni.h>
+
+#include <cstddef>
+#include <string>
+
+// Standard UTF-8 <-> UTF-16 transcoding for java strings. Unlike the
+// modified UTF-8 of GetStringUTFChars/NewStringUTF, supplementary characters
+// are four byte sequences and NUL is a plain zero byte. Invalid input
+// becomes U+FFFD.
+
+// dst needs room for 3 * n bytes, returns the bytes written
+size_t utf16ToUtf8(jchar const * src, size_t n, char * dst);
+
+// dst needs room for n units, returns the units written
+size_t utf8ToUtf16(char const * src, size_t n, jchar * dst);
+
+// Transcodes the string straight from the java heap
+std::string utf8String(JNIEnv * env, jstring str);
+
+jstring newUtf8String(JNIEnv * env, char const * str, size_t n);
+
+inline jstring newUtf8String(JNIEnv * env, std::string const & str)
+{
+    return newUtf8String(env, str.data(), str.size());
+}
+
+#endif // JNIUTF_H
@@ -2,6 +2,9 @@
 #include "jniclass.h"
 
 #include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
 
 struct JniConverter : public Class
 {
@@ -15,92 +18,226 @@ struct JniConverter : public Class
 
 struct BoxConverter : JniConverter
 {
-    BoxConverter(JNIEnv *env, char const * className, char const * valueMethod,
-             char const * valueSignature, char const * initSignature)
+    BoxConverter(JNIEnv *env, char const * className, char const * valueMethod, char signature)
         : JniConverter(env, className)
+        , cacheMin_(0)
     {
-        unbox_ = env->GetMethodID(clazz_, valueMethod, valueSignature);
-        box_ = env_->GetMethodID(clazz_, "<init>", initSignature);
+        std::string sig(1, signature);
+        unbox_ = env->GetMethodID(clazz_, valueMethod, ("()" + sig).c_str());
+        box_ = env->GetStaticMethodID(clazz_, "valueOf", ("(" + sig + ")L" + className + ";").c_str());
+        JLocalClassRef arrayClazz(env, env->FindClass(("[" + sig).c_str()));
+        arrayClazz_ = static_cast<jclass>(env->NewGlobalRef(arrayClazz));
         JThrowable::check(env);
     }
-    Value toArrayValue(jobject jarray)
-    {
-        int n = getArrayLength(jarray);
-        void * array = getArrayElements(jarray);
-        Array varray;
-        for (int i = 0; i < n; ++i) {
-            varray.emplace_back(getArrayValue(array, i));
+    jclass arrayClazz() const { return arrayClazz_; }
+    virtual Value toArrayValue(jobject jarray) = 0;
+    virtual jobject fromArrayValue(Value const & value) = 0;
+protected:
+    // Boxes of [min, max] kept as global refs, like the valueOf caches
+    template <typename JElem>
+    void fillCache(JNIEnv * env, jlong min, jlong max) {
+        cacheMin_ = min;
+        for (jlong i = min; i <= max; ++i) {
+            JLocalObjectRef o(env, env->CallStaticObjectMethod(clazz_, box_, static_cast<JElem>(i)));
+            cache_.push_back(env->NewGlobalRef(o));
         }
-        releaseArrayElements(jarray, array, false);
-        return std::move(varray);
     }
-    jobject fromArrayValue(Value const & value)
-    {
-        Array const & varray = value.toArray();
-        int n = static_cast<int>(varray.size());
-        jobject jarray = newArray(n);
-        void * array = getArrayElements(jarray);
-        for (int i = 0; i < n; ++i) {
-            setArrayValue(array, i, varray[static_cast<size_t>(i)]);
-        }
-        releaseArrayElements(jarray, array, true);
-        return jarray;
+    jobject cached(jlong value) {
+        size_t i = static_cast<size_t>(value - cacheMin_);
+        return i < cache_.size() ? env()->NewLocalRef(cache_[i]) : nullptr;
     }
-    int getArrayLength(jobject object) { return env_->GetArrayLength(static_cast<jarray>(object)); }
-    virtual void * getArrayElements(jobject jarrry) = 0;
-    virtual Value getArrayValue(void * array, int index) = 0;
-    virtual jobject newArray(int length) = 0;
-    virtual void setArrayValue(void * array, int index, Value const & value) = 0;
-    virtual void releaseArrayElements(jobject jarrry, void * array, bool commit) = 0;
 protected:
     jmethodID unbox_;
     jmethodID box_;
+    jclass arrayClazz_;
+    jlong cacheMin_;
+    std::vector<jobject> cache_;
+};
+
+// Per element type: box class, unbox call, array allocation, the range of
+// boxes cached native side (empty when CacheMin > CacheMax) and Value
+// conversions. Value conversions make no JNI calls, they run in critical
+// regions.
+template <typename JElem> struct Primitive;
+
+template <> struct Primitive<jboolean>
+{
+    typedef jbooleanArray JArray;
+    enum : jlong { CacheMin = 0, CacheMax = 1 };
+    static char const * className() { return "java/lang/Boolean"; }
+    static char const * valueMethod() { return "booleanValue"; }
+    static char signature() { return 'Z'; }
+    static jboolean unbox(JNIEnv * env, jobject o, jmethodID m) { return env->CallBooleanMethod(o, m); }
+    static JArray newArray(JNIEnv * env, jsize n) { return env->NewBooleanArray(n); }
+    static Value toValue(jboolean v) { return v != JNI_FALSE; }
+    static jboolean fromValue(Value const & v) { return v.toBool() ? JNI_TRUE : JNI_FALSE; }
+};
+
+template <> struct Primitive<jbyte>
+{
+    typedef jbyteArray JArray;
+    enum : jlong { CacheMin = -128, CacheMax = 127 };
+    static char const * className() { return "java/lang/Byte"; }
+    static char const * valueMethod() { return "byteValue"; }
+    static char signature() { return 'B'; }
+    static jbyte unbox(JNIEnv * env, jobject o, jmethodID m) { return env->CallByteMethod(o, m); }
+    static JArray newArray(JNIEnv * env, jsize n) { return env->NewByteArray(n); }
+    static Value toValue(jbyte v) { return static_cast<int>(v); }
+    static jbyte fromValue(Value const & v) { return static_cast<jbyte>(v.toInt()); }
+};
+
+template <> struct Primitive<jchar>
+{
+    typedef jcharArray JArray;
+    enum : jlong { CacheMin = 0, CacheMax = 127 };
+    static char const * className() { return "java/lang/Character"; }
+    static char const * valueMethod() { return "charValue"; }
+    static char signature() { return 'C'; }
+    static jchar unbox(JNIEnv * env, jobject o, jmethodID m) { return env->CallCharMethod(o, m); }
+    static JArray newArray(JNIEnv * env, jsize n) { return env->NewCharArray(n); }
+    static Value toValue(jchar v) { return static_cast<int>(v); }
+    static jchar fromValue(Value const & v) { return static_cast<jchar>(v.toInt()); }
+};
+
+template <> struct Primitive<jshort>
+{
+    typedef jshortArray JArray;
+    enum : jlong { CacheMin = -128, CacheMax = 127 };
+    static char const * className() { return "java/lang/Short"; }
+    static char const * valueMethod() { return "shortValue"; }
+    static char signature() { return 'S'; }
+    static jshort unbox(JNIEnv * env, jobject o, jmethodID m) { return env->CallShortMethod(o, m); }
+    static JArray newArray(JNIEnv * env, jsize n) { return env->NewShortArray(n); }
+    static Value toValue(jshort v) { return static_cast<int>(v); }
+    static jshort fromValue(Value const & v) { return static_cast<jshort>(v.toInt()); }
+};
+
+template <> struct Primitive<jint>
+{
+    typedef jintArray JArray;
+    enum : jlong { CacheMin = -128, CacheMax = 127 };
+    static char const * className() { return "java/lang/Integer"; }
+    static char const * valueMethod() { return "intValue"; }
+    static char signature() { return 'I'; }
+    static jint unbox(JNIEnv * env, jobject o, jmethodID m) { return env->CallIntMethod(o, m); }
+    static JArray newArray(JNIEnv * env, jsize n) { return env->NewIntArray(n); }
+    static Value toValue(jint v) { return v; }
+    static jint fromValue(Value const & v) { return v.toInt(); }
+};
+
+template <> struct Primitive<jlong>
+{
+    typedef jlongArray JArray;
+    enum : jlong { CacheMin = -128, CacheMax = 127 };
+    static char const * className() { return "java/lang/Long"; }
+    static char const * valueMethod() { return "longValue"; }
+    static char signature() { return 'J'; }
+    static jlong unbox(JNIEnv * env, jobject o, jmethodID m) { return env->CallLongMethod(o, m); }
+    static JArray newArray(JNIEnv * env, jsize n) { return env->NewLongArray(n); }
+    static Value toValue(jlong v) { return v; }
+    static jlong fromValue(Value const & v) { return v.toLong(); }
+};
+
+template <> struct Primitive<jfloat>
+{
+    typedef jfloatArray JArray;
+    enum : jlong { CacheMin = 0, CacheMax = -1 };
+    static char const * className() { return "java/lang/Float"; }
+    static char const * valueMethod() { return "floatValue"; }
+    static char signature() { return 'F'; }
+    static jfloat unbox(JNIEnv * env, jobject o, jmethodID m) { return env->CallFloatMethod(o, m); }
+    static JArray newArray(JNIEnv * env, jsize n) { return env->NewFloatArray(n); }
+    static Value toValue(jfloat v) { return v; }
+    static jfloat fromValue(Value const & v) { return v.toFloat(); }
+};
+
+template <> struct Primitive<jdouble>
+{
+    typedef jdoubleArray JArray;
+    enum : jlong { CacheMin = 0, CacheMax = -1 };
+    static char const * className() { return "java/lang/Double"; }
+    static char const * valueMethod() { return "doubleValue"; }
+    static char signature() { return 'D'; }
+    static jdouble unbox(JNIEnv * env, jobject o, jmethodID m) { return env->CallDoubleMethod(o, m); }
+    static JArray newArray(JNIEnv * env, jsize n) { return env->NewDoubleArray(n); }
+    static Value toValue(jdouble v) { return v; }
+    static jdouble fromValue(Value const & v) { return v.toDouble(); }
 };
 
-#define DEFINE_BOX_CONVERTER(boxType, primitiveType, typeSignature) \
-    struct boxType ## Converter : BoxConverter \
-{ \
-    typedef j ## primitiveType JElem; \
-    typedef j ## primitiveType ## Array JArray; \
-    boxType ## Converter(JNIEnv *env) : BoxConverter(env, "java/lang/" #boxType, \
-            #primitiveType "Value", "()" #typeSignature, "(" #typeSignature ")V") {} \
-    virtual Value toValue(jobject object) override { \
-            return env_->Call ## boxType ## Method(object, unbox_); } \
-    virtual jobject fromValue(Value const & value) override { \
-            return env_->NewObject(clazz_, box_, static_cast<JElem>(value.to ## boxType ())); } \
-    virtual void * getArrayElements(jobject jarray) override { \
-            return env_->Get ## boxType ## ArrayElements(static_cast<JArray>(jarray), nullptr); } \
-    virtual Value getArrayValue(void * array, int index) override { \
-            return static_cast<JElem*>(array)[index]; } \
-    virtual jarray newArray(int length) override { return env_->New ## boxType ## Array(length); } \
-    virtual void setArrayValue(void * array, int index, Value const & value) override { \
-            JElem v = static_cast<JElem>(value.to ## boxType ()); \
-            static_cast<JElem*>(array)[index] = v; } \
-    virtual void releaseArrayElements(jobject jarray, void * array, bool commit) override { \
-            env_->Release ## boxType ## ArrayElements(static_cast<JArray>(jarray), static_cast<JElem*>(array), commit ? 0 : JNI_ABORT); } \
+// Element loops are monomorphic, no virtual or JNI calls per element
+template <typename JElem>
+struct PrimitiveConverter : BoxConverter
+{
+    typedef Primitive<JElem> P;
+    typedef typename P::JArray JArray;
+    PrimitiveConverter(JNIEnv *env) : BoxConverter(env, P::className(), P::valueMethod(), P::signature()) {
+        fillCache<JElem>(env, P::CacheMin, P::CacheMax);
+    }
+    virtual Value toValue(jobject object) override {
+        return P::toValue(P::unbox(env(), object, unbox_));
+    }
+    virtual jobject fromValue(Value const & value) override {
+        JElem v = P::fromValue(value);
+        if (P::CacheMin <= P::CacheMax) {
+            if (jobject o = cached(static_cast<jlong>(v)))
+                return o;
+        }
+        return env()->CallStaticObjectMethod(clazz_, box_, v);
+    }
+    virtual Value toArrayValue(jobject object) override {
+        JArray jarray = static_cast<JArray>(object);
+        jsize n = env()->GetArrayLength(jarray);
+        Array varray;
+        varray.reserve(static_cast<size_t>(n));
+        JElem const * array = static_cast<JElem const *>(env()->GetPrimitiveArrayCritical(jarray, nullptr));
+        // out of memory, an exception is pending
+        if (array == nullptr)
+            return Value();
+        for (jsize i = 0; i < n; ++i)
+            varray.emplace_back(P::toValue(array[i]));
+        env()->ReleasePrimitiveArrayCritical(jarray, const_cast<JElem *>(array), JNI_ABORT);
+        return std::move(varray);
+    }
+    virtual jobject fromArrayValue(Value const & value) override {
+        Array const & varray = value.toArray();
+        jsize n = static_cast<jsize>(varray.size());
+        JArray jarray = P::newArray(env(), n);
+        if (jarray == nullptr)
+            return nullptr;
+        JElem * array = static_cast<JElem *>(env()->GetPrimitiveArrayCritical(jarray, nullptr));
+        if (array == nullptr) {
+            env()->DeleteLocalRef(jarray);
+            return nullptr;
+        }
+        Value const * v = varray.data();
+        for (jsize i = 0; i < n; ++i)
+            array[i] = P::fromValue(v[i]);
+        env()->ReleasePrimitiveArrayCritical(jarray, array, 0);
+        return jarray;
+    }
 };
 
 struct StringConverter : JniConverter
 {
     StringConverter(JNIEnv *env) : JniConverter(env, "java/lang/String") {}
     virtual Value toValue(jobject object) override {
-        return static_cast<std::string>(JString(env_, static_cast<jstring>(object)));
+        return utf8String(env(), static_cast<jstring>(object));
     }
     virtual jobject fromValue(Value const & value) override {
-        return env_->NewStringUTF(value.toString().c_str());
+        return newUtf8String(env(), value.toString());
     }
 };
 
 // handle jobjectArray only
 struct ArrayConverter : JniConverter
 {
-    ArrayConverter(JNIEnv *env) : JniConverter(env) {}
+    ArrayConverter(JNIEnv *env) : JniConverter(env, "[Ljava/lang/Object;") {}
     virtual Value toValue(jobject object) override {
         jobjectArray array = static_cast<jobjectArray>(object);
         Array array2;
-        int n = env_->GetArrayLength(array);
+        int n = env()->GetArrayLength(array);
         for (int i = 0; i < n; ++i) {
-            JLocalObjectRef object(env_, env_->GetObjectArrayElement(array, i));
+            JLocalObjectRef object(env(), env()->GetObjectArrayElement(array, i));
             array2.emplace_back(JniVariant::toValue(object));
         }
         return std::move(array2);
@@ -108,9 +245,10 @@ struct ArrayConverter : JniConverter
     virtual jobject fromValue(Value const & value) override {
         Array const & varray = value.toArray();
         int n = static_cast<int>(varray.size());
-        jobjectArray jarray = env_->NewObjectArray(n, classClass().objectClass(), nullptr);
+        jobjectArray jarray = env()->NewObjectArray(n, classClass().objectClass(), nullptr);
         for (int i = 0; i < n; ++i) {
-            env_->SetObjectArrayElement(jarray, i, JniVariant::fromValue(varray[static_cast<size_t>(i)]));
+            JLocalObjectRef item(env(), JniVariant::fromValue(varray[static_cast<size_t>(i)]));
+            env()->SetObjectArrayElement(jarray, i, item);
         }
         return jarray;
     }
@@ -119,21 +257,25 @@ struct ArrayConverter : JniConverter
 struct ArrayListClass : Class
 {
     ArrayListClass(JNIEnv * env)
-        : Class(env, "java/lang/ArrayList")
+        : Class(env, "java/util/ArrayList")
     {
+        initCapacity_ = env->GetMethodID(clazz_, "<init>", "(I)V");
         add_ = env->GetMethodID(clazz_, "add", "(Ljava/lang/Object;)Z");
     }
-    void add(jobject iterator, jobject entry) { env_->CallVoidMethod(iterator, add_, entry); }
+    jobject newInstance(jint capacity) { return env()->NewObject(clazz_, initCapacity_, capacity); }
+    void add(jobject list, jobject entry) { env()->CallBooleanMethod(list, add_, entry); }
+    jmethodID initCapacity_;
     jmethodID add_;
 };
 
 struct IterableConverter : JniConverter
 {
-    IterableConverter(JNIEnv *env) : JniConverter(env, "java/lang/Iterable"), iteratorConverter_(env) {
+    IterableConverter(JNIEnv *env) : JniConverter(env, "java/lang/Iterable"),
+            iteratorConverter_(env), arrayListClass_(env) {
         iterator_ = env->GetMethodID(clazz_, "iterator", "()Ljava/util/Iterator;");
     }
     jobject iterater(jobject object) {
-        return env_->CallObjectMethod(object, iterator_);
+        return env()->CallObjectMethod(object, iterator_);
     }
     struct IteratorConverter;
     IteratorConverter & iteratorConverter() {
@@ -141,9 +283,9 @@ struct IterableConverter : JniConverter
     }
     virtual Value toValue(jobject object) override {
         Array varray;
-        jobject iterater = this->iterater(object);
+        JLocalObjectRef iterater(env(), this->iterater(object));
         while (iteratorConverter_.hasNext(iterater)) {
-            JLocalObjectRef o(env_, iteratorConverter_.next(iterater));
+            JLocalObjectRef o(env(), iteratorConverter_.next(iterater));
             varray.emplace_back(JniVariant::toValue(o));
         }
         return std::move(varray);
@@ -151,11 +293,10 @@ struct IterableConverter : JniConverter
     virtual jobject fromValue(Value const & value) override {
         Array const & varray = value.toArray();
         int n = static_cast<int>(varray.size());
-        static ArrayListClass alc(env_);
-        jobject jlist = alc.newInstance();
+        jobject jlist = arrayListClass_.newInstance(n);
         for (int i = 0; i < n; ++i) {
-            JLocalObjectRef item(env_, JniVariant::fromValue(varray[static_cast<size_t>(i)]));
-            alc.add(jlist, item);
+            JLocalObjectRef item(env(), JniVariant::fromValue(varray[static_cast<size_t>(i)]));
+            arrayListClass_.add(jlist, item);
         }
         return jlist;
     }
@@ -166,8 +307,8 @@ public:
             hasNext_ = env->GetMethodID(clazz_, "hasNext", "()Z");
             next_ = env->GetMethodID(clazz_, "next", "()Ljava/lang/Object;");
         }
-        bool hasNext(jobject iterator) { return env_->CallBooleanMethod(iterator, hasNext_); }
-        jobject next(jobject iterator) { return env_->CallObjectMethod(iterator, next_); }
+        bool hasNext(jobject iterator) { return env()->CallBooleanMethod(iterator, hasNext_); }
+        jobject next(jobject iterator) { return env()->CallObjectMethod(iterator, next_); }
         virtual Value toValue(jobject) override { return Value(); }
         virtual jobject fromValue(const Value &) override { return nullptr; }
     private:
@@ -177,47 +318,57 @@ public:
 protected:
     jmethodID iterator_;
     IteratorConverter iteratorConverter_;
+    ArrayListClass arrayListClass_;
 };
 
-struct TreeMapClass : Class
+// Keeps the sorted order of Map, unlike TreeMap it can be presized
+struct LinkedHashMapClass : Class
 {
-    TreeMapClass(JNIEnv * env)
-        : Class(env, "java/util/TreeMap")
+    LinkedHashMapClass(JNIEnv * env)
+        : Class(env, "java/util/LinkedHashMap")
     {
+        initCapacity_ = env->GetMethodID(clazz_, "<init>", "(I)V");
         put_ = env->GetMethodID(clazz_, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
     }
-    void put(jobject map, jobject key, jobject entry) { env_->CallObjectMethod(map, put_, key, entry); }
+    // room for size entries at the default load factor
+    jobject newInstance(size_t size) {
+        return env()->NewObject(clazz_, initCapacity_, static_cast<jint>(size + size / 3 + 1));
+    }
+    void put(jobject map, jobject key, jobject entry) {
+        JLocalObjectRef old(env(), env()->CallObjectMethod(map, put_, key, entry));
+    }
+    jmethodID initCapacity_;
     jmethodID put_;
 };
 
 struct MapConverter : JniConverter
 {
     MapConverter(JNIEnv *env, IterableConverter * iterable) : JniConverter(env, "java/util/Map"),
-            iterableConverter_(iterable), entryConverter_(env) {
+            iterableConverter_(iterable), entryConverter_(env), mapClass_(env) {
         entrySet_ = env->GetMethodID(clazz_, "entrySet", "()Ljava/util/Set;");
     }
     virtual Value toValue(jobject object) override {
         Map map;
-        jobject set = env_->CallObjectMethod(object, entrySet_);
-        jobject iterater = iterableConverter_->iterater(set);
+        JLocalObjectRef set(env(), env()->CallObjectMethod(object, entrySet_));
+        JLocalObjectRef iterater(env(), iterableConverter_->iterater(set));
         IterableConverter::IteratorConverter & iteratorConverter = iterableConverter_->iteratorConverter();
         ClassClass & cc = classClass();
         while (iteratorConverter.hasNext(iterater)) {
+            JLocalFrame frame(env(), 4);
             jobject entry = iteratorConverter.next(iterater);
-            JLocalObjectRef key(env_, entryConverter_.getKey(entry));
-            JLocalObjectRef value(env_, entryConverter_.getValue(entry));
+            jobject key = entryConverter_.getKey(entry);
+            jobject value = entryConverter_.getValue(entry);
             map.emplace(cc.toString(key), JniVariant::toValue(value));
         }
         return std::move(map);
     }
     virtual jobject fromValue(Value const & value) override {
         Map const & map = value.toMap();
-        static TreeMapClass tmc(env_);
-        jobject jmap = tmc.newInstance();
+        jobject jmap = mapClass_.newInstance(map.size());
         for (auto & it : map) {
-            JLocalObjectRef key(env_, env_->NewStringUTF(it.first.c_str()));
-            JLocalObjectRef value(env_, JniVariant::fromValue(it.second));
-            tmc.put(jmap, key, value);
+            JLocalObjectRef key(env(), newUtf8String(env(), it.first));
+            JLocalObjectRef value(env(), JniVariant::fromValue(it.second));
+            mapClass_.put(jmap, key, value);
         }
         return jmap;
     }
@@ -228,8 +379,8 @@ private:
             getKey_ = env->GetMethodID(clazz_, "getKey", "()Ljava/lang/Object;");
             getValue_ = env->GetMethodID(clazz_, "getValue", "()Ljava/lang/Object;");
         }
-        jobject getKey(jobject entry) { return env_->CallObjectMethod(entry, getKey_); }
-        jobject getValue(jobject entry) { return env_->CallObjectMethod(entry, getValue_); }
+        jobject getKey(jobject entry) { return env()->CallObjectMethod(entry, getKey_); }
+        jobject getValue(jobject entry) { return env()->CallObjectMethod(entry, getValue_); }
         virtual Value toValue(jobject) override { return Value(); }
         virtual jobject fromValue(const Value &) override { return nullptr; }
     private:
@@ -239,43 +390,17 @@ private:
     jmethodID entrySet_;
     IterableConverter * iterableConverter_;
     EntryConverter entryConverter_;
+    LinkedHashMapClass mapClass_;
 };
 
-#define toBoolean toBool
-#define GetBooleanArrayElement GetBoolArrayElement
-DEFINE_BOX_CONVERTER(Boolean, boolean, Z)
-#undef toBoolean
-#define toByte toInt
-DEFINE_BOX_CONVERTER(Byte, byte, B)
-#undef toByte
-#define toCharacter toInt
-#define CallCharacterMethod CallIntMethod
-#define GetCharacterArrayElements GetCharArrayElements
-#define NewCharacterArray NewCharArray
-#define ReleaseCharacterArrayElements ReleaseCharArrayElements
-DEFINE_BOX_CONVERTER(Character, char, C)
-#undef ReleaseIntegerArrayElements
-#undef NewCharacterArray
-#undef GetCharacterArrayElements
-#undef CallCharacterMethod
-#undef toChar
-#define toShort toInt
-DEFINE_BOX_CONVERTER(Short, short, S)
-#undef toShort
-#define CallIntegerMethod CallIntMethod
-#define toInteger toInt
-#define GetIntegerArrayElements GetIntArrayElements
-#define NewIntegerArray NewIntArray
-#define ReleaseIntegerArrayElements ReleaseIntArrayElements
-DEFINE_BOX_CONVERTER(Integer, int, I)
-#undef ReleaseIntegerArrayElements
-#undef NewIntegerArray
-#undef GetIntegerArrayElements
-#undef toInteger
-#undef CallIntergerMethod
-DEFINE_BOX_CONVERTER(Long, long, J)
-DEFINE_BOX_CONVERTER(Float, float, F)
-DEFINE_BOX_CONVERTER(Double, double, D)
+typedef PrimitiveConverter<jboolean> BooleanConverter;
+typedef PrimitiveConverter<jbyte> ByteConverter;
+typedef PrimitiveConverter<jchar> CharacterConverter;
+typedef PrimitiveConverter<jshort> ShortConverter;
+typedef PrimitiveConverter<jint> IntegerConverter;
+typedef PrimitiveConverter<jlong> LongConverter;
+typedef PrimitiveConverter<jfloat> FloatConverter;
+typedef PrimitiveConverter<jdouble> DoubleConverter;
 
 struct Converters {
     enum {
@@ -307,33 +432,83 @@ void JniVariant::init(JNIEnv *env)
     std::copy(classes2, classes2 + 12, classes);
 }
 
-Value::Type JniVariant::type(jclass type)
+// What to do with instances of a class, resolved on first sighting
+struct ClassInfo
 {
-    ClassClass & ci = classClass();
-    if (ci.isArray(type)) {
-        return Value::Array_;
-    }
-    JniConverter ** pjc = std::find_if(classes, classes + 9, [type] (JniConverter * jc) {
-        return *jc == type;
-    });
-    if (pjc < classes + Converters::Array) {
-        int n = static_cast<int>(pjc - classes);
-        if (n == Converters::Boolean) {
-            n = Value::Bool;
-        } else if (n < Converters::Long) {
-            n = Value::Int;
-        } else {
-            n =  n - Converters::Long + Value::Long;
+    int converter; // index in classes, -1 for object references and primitives
+    bool array; // primitive array of a box converter
+    Value::Type type;
+    char signature; // see JniVariant::signature
+};
+
+// signature chars of box converters, upper case for the primitive, lower case for its array
+static char const s_boxSignatures[] = "ZBCSIJFD";
+static char const s_boxArraySignatures[] = "zbcsijfd";
+
+static JClassMap<ClassInfo> s_classInfos;
+
+static ClassInfo resolveClassInfo(JNIEnv * env, jclass clazz)
+{
+    for (int i = Converters::Boolean; i <= Converters::Double; ++i) {
+        BoxConverter * bc = static_cast<BoxConverter*>(classes[i]);
+        if (env->IsSameObject(bc->arrayClazz(), clazz))
+            return ClassInfo{i, true, Value::Array_, s_boxArraySignatures[i]};
+        if (env->IsSameObject(bc->clazz(), clazz)) {
+            Value::Type type = i == Converters::Boolean ? Value::Bool
+                    : i < Converters::Long ? Value::Int
+                    : i == Converters::Long ? Value::Long
+                    : i == Converters::Float ? Value::Float : Value::Double;
+            return ClassInfo{i, false, type, 'L'};
         }
-        return static_cast<Value::Type>(n);
-    }
-    if (ci.isAssignableFrom(classes[Converters::Iterable]->clazz(), type)) {
-        return Value::Array_;
     }
-    if (ci.isAssignableFrom(classes[Converters::Map]->clazz(), type)) {
-        return Value::Map_;
+    if (env->IsSameObject(classes[Converters::String]->clazz(), clazz))
+        return ClassInfo{Converters::String, false, Value::String, 'L'};
+    if (env->IsAssignableFrom(clazz, classes[Converters::Array]->clazz()))
+        return ClassInfo{Converters::Array, false, Value::Array_, 'L'};
+    if (env->IsAssignableFrom(clazz, classes[Converters::Iterable]->clazz()))
+        return ClassInfo{Converters::Iterable, false, Value::Array_, 'L'};
+    if (env->IsAssignableFrom(clazz, classes[Converters::Map]->clazz()))
+        return ClassInfo{Converters::Map, false, Value::Map_, 'L'};
+    ClassClass & ci = classClass();
+    if (ci.isPrimitive(clazz)) {
+        static char const * const names[] = {
+            "boolean", "byte", "char", "short", "int", "long", "float", "double"
+        };
+        static Value::Type const types[] = {
+            Value::Bool, Value::Int, Value::Int, Value::Int, Value::Int, Value::Long, Value::Float, Value::Double
+        };
+        std::string name = ci.getName(clazz);
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+            if (name == names[i])
+                return ClassInfo{-1, false, types[i], s_boxSignatures[i]};
+        }
+        return ClassInfo{-1, false, Value::None, 'V'};
     }
-    return Value::Object_;
+    return ClassInfo{-1, false, Value::Object_, 'L'};
+}
+
+static ClassInfo const & classInfo(JNIEnv * env, jclass clazz)
+{
+    jint hash = s_classInfos.hash(env, clazz);
+    ClassInfo * info = s_classInfos.find(env, clazz, hash);
+    if (info == nullptr)
+        info = s_classInfos.insert(env, clazz, hash, resolveClassInfo(env, clazz));
+    return *info;
+}
+
+Value::Type JniVariant::type(jclass type)
+{
+    return classInfo(jniEnv(), type).type;
+}
+
+char JniVariant::signature(jclass clazz)
+{
+    return classInfo(jniEnv(), clazz).signature;
+}
+
+bool JniVariant::isReference(char signature)
+{
+    return signature == 'L' || (signature >= 'a' && signature <= 'z');
 }
 
 // ProxyObject.invoke(args): args
@@ -343,31 +518,19 @@ Value::Type JniVariant::type(jclass type)
 
 Value JniVariant::toValue(jobject object)
 {
-    ClassClass & ci = classClass();
-    jclass type = ci.getClass(object);
-    jclass comtype = nullptr;
-    if (ci.isArray(type)) {
-        comtype = ci.getComponentType(type);
-    }
-    JniConverter ** pjc = std::find_if(classes, classes + 9, [type] (JniConverter * jc) {
-        return *jc == type;
-    });
-    if (pjc < classes + Converters::Array) {
-        if (comtype == nullptr)
-            return (*pjc)->toValue(object);
-        else
-            return static_cast<BoxConverter*>(*pjc)->toArrayValue(static_cast<jarray>(object));
-    }
-    if (comtype != nullptr) {
-        return classes[Converters::Array]->toValue(object);
-    }
-    if (ci.isInstance(classes[Converters::Iterable]->clazz(), object)) {
-        return classes[Converters::Iterable]->toValue(object);
-    }
-    if (ci.isInstance(classes[Converters::Map]->clazz(), object)) {
-        return classes[Converters::Map]->toValue(object);
-    }
-    return Value(registerObject(classes[0]->env(), object));
+    if (object == nullptr)
+        return Value();
+    JNIEnv * env = jniEnv();
+    ClassInfo info;
+    {
+        JLocalClassRef clazz(env, env->GetObjectClass(object));
+        info = classInfo(env, clazz);
+    }
+    if (info.converter < 0)
+        return Value(registerObject(env, object));
+    if (info.array)
+        return static_cast<BoxConverter*>(classes[info.converter])->toArrayValue(object);
+    return classes[info.converter]->toValue(object);
 }
 
 // init(): result
@@ -392,48 +555,192 @@ jobject JniVariant::fromValue(const Value &v)
     else if (v.isBool())
         return classes[Converters::Boolean]->fromValue(v);
     else if (v.isArray()) {
-        return classes[Converters::Array]->fromValue(v); // TODO: support primitive array
+        // without a target type arrays stay Object[], see fromValue(value, signature)
+        return classes[Converters::Array]->fromValue(v);
     } else if (v.isMap()) {
         return classes[Converters::Map]->fromValue(v);
     } else if (v.isObject()) {
-        return static_cast<jobject>(v.toObject());
+        // callers own the result, never hand out the registered weak ref
+        return jniEnv()->NewLocalRef(static_cast<jobject>(v.toObject()));
     }
     return nullptr;
 }
 
-static std::vector<jobject> s_objects;
+Value JniVariant::toValue(jvalue value, char signature)
+{
+    switch (signature) {
+    case 'Z':
+        return value.z != JNI_FALSE;
+    case 'B':
+        return static_cast<int>(value.b);
+    case 'C':
+        return static_cast<int>(value.c);
+    case 'S':
+        return static_cast<int>(value.s);
+    case 'I':
+        return static_cast<int>(value.i);
+    case 'J':
+        return value.j;
+    case 'F':
+        return value.f;
+    case 'D':
+        return value.d;
+    default:
+        return isReference(signature) && value.l ? toValue(value.l) : Value();
+    }
+}
 
-jobject JniVariant::registerObject(JNIEnv * env, jobject object)
+jvalue JniVariant::fromValue(const Value &v, char signature)
 {
-    auto it = std::find(s_objects.begin(), s_objects.end(), object);
-    if (it == s_objects.end()) {
-        it = std::find_if(s_objects.begin(), s_objects.end(), JObjectFinder(env, object));
-        if (it == s_objects.end()) {
-            object = env->NewWeakGlobalRef(object);
-            s_objects.push_back(object);
-        } else {
-            object = *it;
+    jvalue value;
+    value.j = 0;
+    switch (signature) {
+    case 'Z':
+        value.z = v.toBool() ? JNI_TRUE : JNI_FALSE;
+        break;
+    case 'B':
+        value.b = static_cast<jbyte>(v.toInt());
+        break;
+    case 'C':
+        value.c = static_cast<jchar>(v.toInt());
+        break;
+    case 'S':
+        value.s = static_cast<jshort>(v.toInt());
+        break;
+    case 'I':
+        value.i = static_cast<jint>(v.toInt());
+        break;
+    case 'J':
+        value.j = static_cast<jlong>(v.toLong());
+        break;
+    case 'F':
+        value.f = static_cast<jfloat>(v.toFloat());
+        break;
+    case 'D':
+        value.d = static_cast<jdouble>(v.toDouble());
+        break;
+    case 'L':
+        value.l = fromValue(v);
+        break;
+    default:
+        if (isReference(signature)) {
+            char const * p = strchr(s_boxArraySignatures, signature);
+            value.l = p && v.isArray()
+                    ? static_cast<BoxConverter*>(classes[p - s_boxArraySignatures])->fromArrayValue(v)
+                    : fromValue(v);
         }
-    } else {
+        break;
+    }
+    return value;
+}
+
+// Registered objects as weak global refs, bucketed by System.identityHashCode
+// so that IsSameObject is only called on collisions.
+class ObjectRegistry
+{
+public:
+    jobject add(JNIEnv * env, jobject object)
+    {
+        jint hash = systemClass(env).identityHashCode(object);
+        std::lock_guard<std::mutex> l(mutex_);
+        std::vector<jobject> & bucket = buckets_[hash];
+        auto it = find(env, bucket, object);
+        if (it != bucket.end())
+            return *it;
+        object = env->NewWeakGlobalRef(object);
+        bucket.push_back(object);
+        return object;
+    }
+
+    jobject find(JNIEnv * env, jobject object)
+    {
+        jint hash = systemClass(env).identityHashCode(object);
+        std::lock_guard<std::mutex> l(mutex_);
+        auto b = buckets_.find(hash);
+        if (b == buckets_.end())
+            return nullptr;
+        auto it = find(env, b->second, object);
+        return it == b->second.end() ? nullptr : *it;
+    }
+
+    jobject remove(JNIEnv * env, jobject object)
+    {
+        jint hash = systemClass(env).identityHashCode(object);
+        std::lock_guard<std::mutex> l(mutex_);
+        auto b = buckets_.find(hash);
+        if (b == buckets_.end())
+            return nullptr;
+        auto it = find(env, b->second, object);
+        if (it == b->second.end())
+            return nullptr;
         object = *it;
+        b->second.erase(it);
+        if (b->second.empty())
+            buckets_.erase(b);
+        return object;
+    }
+
+    size_t sweep(JNIEnv * env, size_t budget, std::vector<jobject> & collected)
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        size_t n = buckets_.bucket_count();
+        size_t count = collected.size();
+        std::vector<jint> keys;
+        for (size_t i = 0; i < budget && i < n && !buckets_.empty(); ++i) {
+            size_t bucket = cursor_++ % n;
+            keys.clear();
+            for (auto it = buckets_.begin(bucket); it != buckets_.end(bucket); ++it)
+                keys.push_back(it->first);
+            for (jint key : keys) {
+                std::vector<jobject> & objects = buckets_[key];
+                auto end = std::remove_if(objects.begin(), objects.end(), [&] (jobject o) {
+                    if (!env->IsSameObject(o, nullptr))
+                        return false;
+                    collected.push_back(o);
+                    return true;
+                });
+                objects.erase(end, objects.end());
+                if (objects.empty())
+                    buckets_.erase(key);
+            }
+        }
+        return collected.size() - count;
     }
-    return object;
+
+private:
+    static std::vector<jobject>::iterator find(JNIEnv * env, std::vector<jobject> & bucket, jobject object)
+    {
+        // object may already be the registered weak ref
+        auto it = std::find(bucket.begin(), bucket.end(), object);
+        if (it == bucket.end())
+            it = std::find_if(bucket.begin(), bucket.end(), JObjectFinder(env, object));
+        return it;
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<jint, std::vector<jobject>> buckets_;
+    size_t cursor_ = 0;
+};
+
+static ObjectRegistry s_objects;
+
+jobject JniVariant::registerObject(JNIEnv * env, jobject object)
+{
+    return s_objects.add(env, object);
 }
 
 jobject JniVariant::findObject(JNIEnv *env, jobject object)
 {
-    auto it = std::find_if(s_objects.begin(), s_objects.end(), JObjectFinder(env, object));
-    if (it == s_objects.end())
-        return nullptr;
-    return *it;
+    return s_objects.find(env, object);
 }
 
 jobject JniVariant::deregisterObject(JNIEnv *env, jobject object)
 {
-    auto it = std::find_if(s_objects.begin(), s_objects.end(), JObjectFinder(env, object));
-    if (it == s_objects.end())
-        return nullptr;
-    object = *it;
-    s_objects.erase(it);
-    return object;
+    return s_objects.remove(env, object);
+}
+
+size_t JniVariant::sweepObjects(JNIEnv *env, size_t budget, std::vector<jobject> &collected)
+{
+    return s_objects.sweep(env, budget, collected);
 }
@@ -5,6 +5,8 @@
 
 #include <jni.h>
 
+#include <vector>
+
 class JniVariant
 {
 public:
@@ -12,15 +14,33 @@ public:
 
     static Value::Type type(jclass clazz);
 
+    // JNI signature char of clazz: 'Z', 'I', ..., 'V' for primitives, the
+    // lower case char for arrays of a primitive ('i' for int[]), 'L' otherwise
+    static char signature(jclass clazz);
+
+    // true for signature chars passed as jobject
+    static bool isReference(char signature);
+
     static Value toValue(jobject object);
 
     static jobject fromValue(Value const & value);
 
+    // typed conversion by signature char, references go through the converters;
+    // arrays are filled in bulk when the signature names a primitive array
+    static Value toValue(jvalue value, char signature);
+
+    static jvalue fromValue(Value const & value, char signature);
+
     static jobject registerObject(JNIEnv * env, jobject object);
 
     static jobject findObject(JNIEnv * env, jobject object);
 
     static jobject deregisterObject(JNIEnv * env, jobject object);
+
+    // Removes registered objects that have been garbage collected, looking
+    // at no more than budget buckets. The cleared weak refs are appended to
+    // collected, the caller owns them.
+    static size_t sweepObjects(JNIEnv * env, size_t budget, std::vector<jobject> & collected);
 };
 
 #endif // JNIVARIANT_H